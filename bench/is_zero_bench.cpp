@@ -0,0 +1,114 @@
+
+// times each implementation of simd::is_zero that this CPU can run, on buffers that are all zeros (the whole buffer is scanned),
+// have their last byte set (scanned up to the end before they are found not to be), and random data (found not to be at once).
+// build with -DEFIBOOTGEN_BENCH=ON, and run is_zero_bench [seconds per measurement]
+
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <random>
+
+#include "simd.h"
+
+namespace
+{
+    struct buffer_case_t
+    {
+        const char*     _name;
+        size_t          _bytes;
+        // what is_zero has to say about it
+        bool            _zero;
+    };
+
+    // fill data for case_
+    void fill(uint8_t* data, const buffer_case_t& case_)
+    {
+        memset(data, 0, case_._bytes);
+        if (!strcmp(case_._name, "last byte set"))
+        {
+            data[case_._bytes - 1] = 1;
+        }
+        else if (!strcmp(case_._name, "random"))
+        {
+            std::mt19937 random{ 42 };
+            for (size_t n = 0; n < case_._bytes; ++n)
+            {
+                data[n] = uint8_t(random() | 1);
+            }
+        }
+    }
+}
+
+int main(int argc, char** argv)
+{
+    const auto seconds = argc > 1 ? std::atof(argv[1]) : 0.25;
+
+    const simd::is_zero_variant_t* variants = nullptr;
+    const auto variant_count = simd::is_zero_variants(&variants);
+    std::cout << "is_zero uses " << simd::is_zero_implementation() << "\n\n";
+
+    static constexpr size_t kSmall = 4096;
+    static constexpr size_t kLarge = 64 * 1024 * 1024;
+    const buffer_case_t cases[] = {
+        { "zero", kSmall, true },
+        { "last byte set", kSmall, false },
+        { "random", kSmall, false },
+        { "zero", kLarge, true },
+        { "last byte set", kLarge, false },
+        { "random", kLarge, false },
+    };
+
+    // 64 byte aligned, as the chunks write_file checks are
+    std::unique_ptr<uint8_t[]> storage{ new uint8_t[kLarge + 64] };
+    auto* data = storage.get() + ((64 - (reinterpret_cast<uintptr_t>(storage.get()) & 63)) & 63);
+
+    std::cout << std::left << std::setw(10) << "bytes" << std::setw(16) << "contents" << std::setw(10) << "variant"
+        << std::right << std::setw(14) << "ns per call" << std::setw(12) << "GB/s" << "\n";
+    auto all_agree = true;
+    for (const auto& case_ : cases)
+    {
+        fill(data, case_);
+        for (size_t v = 0; v < variant_count; ++v)
+        {
+            const auto& variant = variants[v];
+            if (variant._is_zero(data, case_._bytes) != case_._zero)
+            {
+                std::cerr << "*error: " << variant._name << " gets " << case_._name << " wrong\n";
+                all_agree = false;
+            }
+
+            // run it in batches until enough time has gone by
+            using clock_t = std::chrono::steady_clock;
+            size_t calls = 0;
+            size_t zeros = 0;
+            const auto start = clock_t::now();
+            auto elapsed = std::chrono::duration<double>::zero();
+            do
+            {
+                for (auto n = 0; n < 64; ++n)
+                {
+                    zeros += variant._is_zero(data, case_._bytes);
+                }
+                calls += 64;
+                elapsed = clock_t::now() - start;
+            } while (elapsed.count() < seconds);
+
+            const auto ns_per_call = (elapsed.count() * 1e9) / double(calls);
+            // only the scans that run to the end read all of the buffer
+            const auto scanned = strcmp(case_._name, "random") != 0;
+            std::cout << std::left << std::setw(10) << case_._bytes << std::setw(16) << case_._name << std::setw(10) << variant._name
+                << std::right << std::setw(14) << std::fixed << std::setprecision(1) << ns_per_call;
+            if (scanned)
+            {
+                std::cout << std::setw(12) << std::setprecision(1) << double(case_._bytes) / ns_per_call;
+            }
+            // keeps the calls from being optimised away
+            std::cout << (zeros == size_t(-1) ? "!" : "") << "\n";
+        }
+    }
+    return all_agree ? 0 : 1;
+}
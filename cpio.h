@@ -0,0 +1,47 @@
+#pragma once
+
+namespace disktools
+{
+    namespace cpio
+    {
+        // the "new" portable ASCII format (newc) as produced by "cpio -H newc" and used for Linux initramfs images:
+        // https://www.kernel.org/doc/html/latest/driver-api/early-userspace/buffer-format.html
+
+        static constexpr char kNewcMagic[6] = { '0','7','0','7','0','1' };
+        // same as newc but with a checksum of the data in _check, which we ignore
+        static constexpr char kNewcCrcMagic[6] = { '0','7','0','7','0','2' };
+        static constexpr char kTrailerName[] = "TRAILER!!!";
+        // header + name and data are each padded to this
+        static constexpr size_t kAlignment = 4;
+
+        // file type bits of _mode
+        static constexpr uint32_t kModeTypeMask = 0170000;
+        static constexpr uint32_t kModeDirectory = 0040000;
+        static constexpr uint32_t kModeRegular = 0100000;
+
+#pragma pack(push,1)
+        // all fields are 8 hex digits
+        struct newc_header_t
+        {
+            char            _magic[6];
+            char            _ino[8];
+            char            _mode[8];
+            char            _uid[8];
+            char            _gid[8];
+            char            _nlink[8];
+            char            _mtime[8];
+            char            _filesize[8];
+            char            _devmajor[8];
+            char            _devminor[8];
+            char            _rdevmajor[8];
+            char            _rdevminor[8];
+            char            _namesize[8];       // including the terminating NUL
+            char            _check[8];
+
+            // followed by the name, padded so that header + name is a multiple of kAlignment, and then the data, also padded
+        };
+#pragma pack(pop)
+
+        static_assert(sizeof(newc_header_t) == 110);
+    }
+}
@@ -2,23 +2,50 @@
 #include <cassert>
 #include <cstdint>
 #include <iostream>
+#include <iomanip>
 #include <fstream>
 #include <sstream>
 #include <random>
 #include <functional>
 #include <map>
 #include <stack>
+#include <unordered_set>
+#include <tuple>
+#include <array>
+#include <charconv>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
 #include <cstdarg>
+#include <cstring>
 
 // none of these are critical to us at this point
 #pragma warning(disable:5045)
 #pragma warning(disable:4514)
 #pragma warning(disable:4820)
 
+#ifndef _WIN32
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <poll.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#endif
+
 #include "platform.h"
 #include "status.h"
 #include "fat.h"
 #include "gpt.h"
+#include "tar.h"
+#include "cpio.h"
+#include "simd.h"
 #include "disktools.h"
 
 namespace utils
@@ -54,6 +81,66 @@ namespace utils
         return ~crc;
     }
 
+    // FNV-1a, http://www.isthe.com/chongo/tech/comp/fnv/index.html
+    static constexpr uint64_t kFnv1a64Basis = 0xcbf29ce484222325ull;
+    uint64_t fnv1a_64(uint64_t hash, const char* buf, size_t len)
+    {
+        const auto* q = buf + len;
+        for (const auto* p = buf; p < q; p++) {
+            hash = (hash ^ static_cast<unsigned char>(*p)) * 0x100000001b3ull;
+        }
+        return hash;
+    }
+
+    bool equal_ignoring_case(std::string_view a, std::string_view b)
+    {
+        return a.size() == b.size() && std::equal(a.begin(), a.end(), b.begin(), [](char ca, char cb) {
+            return ::toupper(static_cast<unsigned char>(ca)) == ::toupper(static_cast<unsigned char>(cb));
+        });
+    }
+
+    // UTF-8 to UTF-16, invalid sequences become U+FFFD. at most max_units are written, returns the number that were
+    size_t utf8_to_utf16(std::string_view in, char16_t* out, size_t max_units)
+    {
+        size_t units = 0;
+        for (size_t i = 0; i < in.size() && units < max_units;)
+        {
+            const auto lead = static_cast<uint8_t>(in[i]);
+            const size_t length = lead < 0x80 ? 1 : ((lead & 0xe0) == 0xc0 ? 2 : ((lead & 0xf0) == 0xe0 ? 3 : ((lead & 0xf8) == 0xf0 ? 4 : 0)));
+            uint32_t code_point = length == 1 ? lead : (lead & (0x7f >> length));
+            size_t used = 1;
+            if (length > 1)
+            {
+                while (used < length && (i + used) < in.size() && (static_cast<uint8_t>(in[i + used]) & 0xc0) == 0x80)
+                {
+                    code_point = (code_point << 6) | (static_cast<uint8_t>(in[i + used]) & 0x3f);
+                    ++used;
+                }
+            }
+            if (!length || used < length)
+            {
+                code_point = 0xfffd;
+            }
+            i += used;
+
+            if (code_point >= 0x10000)
+            {
+                if (units + 2 > max_units)
+                {
+                    break;
+                }
+                code_point -= 0x10000;
+                out[units++] = char16_t(0xd800 + (code_point >> 10));
+                out[units++] = char16_t(0xdc00 + (code_point & 0x3ff));
+            }
+            else
+            {
+                out[units++] = char16_t(code_point);
+            }
+        }
+        return units;
+    }
+
     namespace uuid
     {
         std::random_device              rd;
@@ -84,6 +171,16 @@ namespace disktools
     bool _preserve_case = false;
     // reformat an existing image (if exists)
     bool _reformat = false;
+    // update an existing image in place where possible
+    bool _update = false;
+    // read source files in the order they are stored on disk
+    bool _physical_order = false;
+    // cluster size in sectors, 0 sizes them by the size of the volume
+    size_t _sectors_per_cluster = 0;
+    // boundary the partition, the data area, and the contents of each file start on, 0 for none
+    size_t _align_bytes = 0;
+    // threads writing file contents, 1 writes them in order
+    size_t _jobs = 1;
 
     // helper to make it a bit more intuitive to use and write sectors to a file
     
@@ -95,13 +192,11 @@ namespace disktools
             std::cout << "\tcreating blank image of " << writer->image().total_sectors() << " " << kSectorSizeBytes << " byte sectors\n";
         }
 
-         writer->seek_from_beg(0);
+        // the image has just been created (and is empty) so writing the last sector is enough, everything before it reads as zeros.
+        // on file systems that support it the image is sparse, i.e. only what is written takes up space
+        writer->seek_from_beg(writer->image().last_lba());
         writer->blank_sector();
-        auto sector_count = writer->image().total_sectors();
-        while (writer->image().good() && sector_count--)
-        {
-            writer->write_sector();
-        }
+        writer->write_sector();
         const auto result = writer->image().good();
         writer->seek_from_beg(0);
         return result;
@@ -111,8 +206,8 @@ namespace disktools
 
     System::status_t disk_sector_image_t::open(const std::string& oName, size_t content_size, bool reformat)
     {
-        // round size up to nearest 128 Megs. This pushes us out of the "floppy disk" domain
-        size_t size = (content_size + (0x8000000 - 1)) & ~(0x8000000 - 1);
+        // round size up to a whole 64K, how big the image has to be for its contents is worked out by fat::image_size_for
+        size_t size = (content_size + (0x10000 - 1)) & ~size_t(0x10000 - 1);
 
         // if the disk image already exists, and we're reformatting, then we'll just keep it (as long as it's big enough)
         _using_existing = false;
@@ -134,11 +229,19 @@ namespace disktools
                     size = image_size;
                     _using_existing = true;
                 }
+                else if (_verbose)
+                {
+                    // images are sized to fit their contents, so this is the case whenever they have grown past the next size up
+                    std::cout << "\texisting disk image " << oName << " is too small (" << image_size << " bytes), it is recreated\n";
+                }
             }
         }
 
         if (!_using_existing)
         {
+            // the existing image may still be open from above, if it was too small
+            _fs.close();
+            _fs.clear();
             _fs.open(oName, std::ios::binary | std::ios::trunc | std::ios::in | std::ios::out);
         }
 
@@ -150,6 +253,7 @@ namespace disktools
         // round up to nearest 512 byte block
         size = (size + (kSectorSizeBytes - 1)) & ~(kSectorSizeBytes - 1);
         _total_sectors = size / kSectorSizeBytes;
+        _path = oName;
 
         return System::Code::OK;
     }
@@ -174,15 +278,13 @@ namespace disktools
 
     char* disk_sector_writer_t::blank_sector(size_t count)
     {
-        if (!_sector || _sectors_in_buffer < count)
+        // the buffer only ever grows, asking for fewer sectors than it holds doesn't give any of it back
+        if (!_sector || _sector_capacity < count)
         {
             delete[] _sector;
-            _sector = new char[kSectorSizeBytes * (_sectors_in_buffer = count)];
-        }
-        else if (_sectors_in_buffer > count)
-        {
-            _sectors_in_buffer = count;
+            _sector = new char[kSectorSizeBytes * (_sector_capacity = count)];
         }
+        _sectors_in_buffer = count;
         memset(_sector, 0, _sectors_in_buffer * kSectorSizeBytes);
         return _sector;
     }
@@ -213,6 +315,19 @@ namespace disktools
         return _image.good();
     }
 
+    bool disk_sector_writer_t::write_sectors_from(const char* data, size_t count)
+    {
+        _image._fs.write(data, count*kSectorSizeBytes);
+        return _image.good();
+    }
+
+    bool disk_sector_writer_t::skip_sectors(size_t count)
+    {
+        _image._fs.seekp(std::ofstream::off_type(count * kSectorSizeBytes), std::ios::cur);
+        _skipped_sectors += count;
+        return _image.good();
+    }
+
     bool disk_sector_reader_t::seek_from_beg(size_t lba)
     {
         if (_image.good())
@@ -246,6 +361,18 @@ namespace disktools
         return _image.good();
     }
 
+    namespace
+    {
+        std::string& normalise_case(std::string& name)
+        {
+            if (!_preserve_case)
+            {
+                std::transform(name.begin(), name.end(), name.begin(), ::toupper);
+            }
+            return name;
+        }
+    }
+
     System::status_or_t<bool> fs_t::add_dir(dir_t* parent, const std::string& sysRootPath)
     {
         //NOTE: we need to keep track of the current directory entry
@@ -255,63 +382,81 @@ namespace disktools
         using recursion_stack_t = std::stack<recursion_stack_item_t>;
         recursion_stack_t rec_stack;
 
+        // only metadata is read here, file contents are streamed from their source paths when the image is written.
+        // anything that already exists in the tree (from an earlier source) is replaced, directories are merged
+        std::string name;
         fs::path fsSystemRootPath{sysRootPath};
         auto i = fs::directory_iterator(fsSystemRootPath);
         for (;;)
         {
             if (i != fs::directory_iterator())
             {
+                name = i->path().filename().string();
+                const auto existing = parent->_entries.find(normalise_case(name));
+                const auto exists = existing != parent->_entries.end();
+
 #ifdef _WIN32
                 if (i->is_directory())
 #else
                 if ( fs::is_directory(i->status()) )
 #endif                
                 {
-                    auto result = create_directory(parent, i->path().filename().string());
-                    if (result)
+                    dir_t* dir = nullptr;
+                    if (exists && existing->second._is_dir)
                     {
-                        const auto rec_path = i->path();
-                        //NOTE: advance past current entry before pushing
-                        rec_stack.emplace(parent, std::move(++i));
-                        parent = result.value();
-                        i = fs::directory_iterator(rec_path);
+                        dir = existing->second._content._dir;
                     }
                     else
                     {
-                        return result.error_code();
+                        if (exists)
+                        {
+                            if (_verbose)
+                            {
+                                std::cout << "\t" << i->path().string() << " replaces file " << name << "\n";
+                            }
+                            remove(parent, name);
+                        }
+
+                        auto result = create_directory(parent, name);
+                        if (!result)
+                        {
+                            return result.error_code();
+                        }
+                        dir = result.value();
                     }
+
+                    const auto rec_path = i->path();
+                    //NOTE: advance past current entry before pushing
+                    rec_stack.emplace(parent, std::move(++i));
+                    parent = dir;
+                    i = fs::directory_iterator(rec_path);
                 }
                 else
                 {
-                    const auto path = i->path().string();
-                    std::ifstream ifs{path, std::ios::binary};
-                    if (ifs.is_open())
+                    std::error_code ec;
+                    const auto size = fs::file_size(i->path(), ec);
+                    if (ec)
                     {
-                        ifs.seekg(0, std::ios::end);
-                        const auto endpos = ifs.tellg();
-                        ifs.seekg(0, std::ios::beg);
-
-                        const auto size = size_t(endpos);
-                        auto* buffer = new char[size];
-                        ifs.read(buffer, size);
-                        ifs.close();
-
-                        auto stem = i->path().stem().string();
-                        const auto ext = i->path().filename().extension().string().substr(1);
-                        //NOTE: "FOO.BAR" -> "FOO     BAR"
-                        const std::string fat_name = stem
-                            .append(std::string(11 - (stem.length()+ext.length()), ' '))
-                            .append(ext);
-                        /* _ =*/
-                        create_file(parent, fat_name, buffer, size);
+                        return System::Code::UNAVAILABLE;
+                    }
 
-                        // next item
-                        ++i;
+                    if (exists)
+                    {
+                        if (_verbose)
+                        {
+                            std::cout << "\t" << i->path().string() << " replaces " << (existing->second._is_dir ? "directory " : "file ") << name << "\n";
+                        }
+                        remove(parent, name);
                     }
-                    else
+
+                    auto result = create_file_from_source(parent, name, store_string(i->path().string()), size_t(size));
+                    if (!result)
                     {
-                        return System::Code::UNAVAILABLE;
+                        return result.error_code();
                     }
+
+                    // next item
+                    ++i;
                 }
             }
 
@@ -335,747 +480,3921 @@ namespace disktools
 
     System::status_or_t<bool> fs_t::create_from_source(std::string_view sourcePath)
     {
-        // strip any leading gunk so that the name is clean for the root directory entry
-        const auto name_start = sourcePath.find_first_not_of("./\\");
-        if (name_start == std::string::npos)
+        //NOTE: sourcePath is used as is, stripping leading "./" or "/" turned absolute paths into relative ones
+        const std::string root_path{ sourcePath };
+        std::error_code ec;
+        if (root_path.empty() || !fs::is_directory(root_path, ec))
         {
             return System::Code::NOT_FOUND;
         }
 
-        const std::string stripped_root_path{ sourcePath.substr(name_start)};        
-        return add_dir(&_root, stripped_root_path);
+        return add_dir(&_root, root_path);
     }
 
-    System::status_or_t<fs_t::dir_t*> fs_t::create_directory(dir_t* parent, std::string name_)
+    System::status_or_t<bool> fs_t::create_from_sources(const std::vector<std::string>& sourcePaths)
     {
-        std::string_view name = name_;
-        if (!_preserve_case)
+        for (const auto& source_path : sourcePaths)
         {
-            std::transform(name_.begin(), name_.end(), name_.begin(), ::toupper);
-        }
-
-        assert(parent->_entries.find(name) == parent->_entries.end());
-
-        dir_entry_t dir_entry{true};
-        dir_entry._content._dir = new dir_t;
-        dir_entry._content._dir->_name = std::move(name_);
-        dir_entry._content._dir->_parent = parent;
-        //NOTE: a directory is limited to 512 bytes = 16 entries here
-        _size += kSectorSizeBytes;
+            if (_verbose)
+            {
+                std::cout << "\tadding layer " << source_path << "\n";
+            }
 
-        parent->_entries.emplace(dir_entry._content._dir->_name, dir_entry);
-        return dir_entry._content._dir;
+            const auto result = create_from_source(source_path);
+            if (!result)
+            {
+                return result;
+            }
+        }
+        return true;
     }
 
-    System::status_or_t<fs_t::file_t*> fs_t::create_file(dir_t* parent, const std::string& name_, const void* data,
-                                                         size_t size)
+    void fs_t::remove(dir_t* parent, std::string_view name)
     {
-        std::string name = name_;
-        if (!_preserve_case)
+        const auto i = parent->_entries.find(name);
+        if (i == parent->_entries.end())
         {
-            std::transform(name_.begin(), name_.end(), name.begin(), ::toupper);
+            return;
         }
 
-        assert(parent->_entries.find(name) == parent->_entries.end());
-        assert(data && size);
-
-        dir_entry_t dir_entry{false};
-        dir_entry._content._file = new file_t;
-        dir_entry._content._file->_parent = parent;
-        dir_entry._content._file->_data = data;
-        dir_entry._content._file->_size = size;
-        _size += size;
-
-        //NOTE: index by NAME not source path
-        parent->_entries.emplace(name, dir_entry);
+        // nodes are owned by the pools, we just need to keep the index and size accounting right
+        std::stack<const dir_t*> dirs;
+        if (i->second._is_dir)
+        {
+            dirs.push(i->second._content._dir);
+        }
+        else
+        {
+            _size -= i->second._content._file->_size;
+            _index.erase(i->second._content._file->_path);
+        }
+        while (!dirs.empty())
+        {
+            const auto* dir = dirs.top();
+            dirs.pop();
+            _size -= kSectorSizeBytes;
+            _index.erase(dir->_path);
+            for (const auto& [entry_name, entry] : dir->_entries)
+            {
+                if (entry._is_dir)
+                {
+                    dirs.push(entry._content._dir);
+                }
+                else
+                {
+                    _size -= entry._content._file->_size;
+                    _index.erase(entry._content._file->_path);
+                }
+            }
+        }
 
-        return dir_entry._content._file;
+        parent->_entries.erase(i);
     }
 
-    void fs_t::dump_contents(const dir_t* dir, int depth) const
+    System::status_or_t<fs_t::dir_entry_t> fs_t::find(std::string_view path) const
     {
-        if (!dir)
-            dir = &_root;
-
-        const auto pad = std::string(depth * 4, ' ');
-        for (auto const& [key, val] : dir->_entries)
+        const auto i = _index.find(path);
+        if (i == _index.end())
         {
-            //NOTE: setw just doesn't work, why?
-            std::cout << pad << key << (val._is_dir ? "\\" : "") << std::endl;
-            if (val._is_dir)
-            {
-                dump_contents(val._content._dir, depth + 1);
-            }
+            return System::Code::NOT_FOUND;
         }
+        return i->second;
     }
 
-    namespace fat
+    bool fs_t::mark_hot(std::string_view path)
     {
-        static constexpr uint8_t kFatOemName[8] = { 'j','O','S','X',' ','6','4',' ' };
-        static constexpr uint8_t kRootFolderName[11] = { 'E','F','I' };
-
-        // helper to write out the FAT for files and directories in an fs_t container
-        struct write_fat16_context_t
+        const dir_entry_t* entry = nullptr;
+        const dir_t* dir = &_root;
+        while (!path.empty())
         {
-            uint16_t* _fat16 = nullptr;
-            uint16_t* _fat16_end = nullptr;
-
-            size_t          _next_free_cluster = 0;
-            size_t          _fat_sector = 0;
-            static constexpr size_t  kMaxClustersPerFat16Sector = kSectorSizeBytes / sizeof(uint16_t);
-            size_t          _bytes_per_cluster = 0;
-            size_t          _entries_per_cluster = 0;
-
-            void check_need_new_sector(disk_sector_writer_t* writer)
+            const auto separator = std::min(path.find_first_of("/\\"), path.size());
+            const auto name = path.substr(0, separator);
+            path.remove_prefix(std::min(separator + 1, path.size()));
+            if (name.empty())
             {
-                if (_fat16 == _fat16_end)
-                {
-                    // flush and allocate next FAT sector
-                    writer->write_sector();
-                    ++_fat_sector;
-                    _fat16 = reinterpret_cast<uint16_t*>(writer->blank_sector());
-                    _fat16_end = _fat16 + kMaxClustersPerFat16Sector;
-                }
+                continue;
             }
-
-            // allocates and writes FAT clusters for the directory structure from dir *depth first*
-            void write_dir(disk_sector_writer_t* writer, const fs_t::dir_t* dir)
+            if (!dir)
             {
-                for (const auto& [name, entry] : dir->_entries)
+                // a file can't be on the way
+                return false;
+            }
+            const auto i = std::find_if(dir->_entries.begin(), dir->_entries.end(), [&](const auto& named) { return utils::equal_ignoring_case(named.first, name); });
+            if (i == dir->_entries.end())
+            {
+                return false;
+            }
+            entry = &i->second;
+            dir = entry->_is_dir ? entry->_content._dir : nullptr;
+        }
+        if (!entry)
+        {
+            return false;
+        }
+
+        auto* parent = entry->_is_dir ? entry->_content._dir->_parent : entry->_content._file->_parent;
+        if (entry->_is_dir)
+        {
+            // everything in a hot directory is hot
+            std::function<void(dir_t*)> mark_all = [&](dir_t* dir) {
+                dir->_hot = true;
+                for (auto& [name, child] : dir->_entries)
                 {
-                    if (entry._is_dir)
+                    if (child._is_dir)
                     {
-                        //TODO: more things
-                        assert(entry._content._dir->_entries.size() <= _entries_per_cluster);
-                        entry._content._dir->_start_cluster = _next_free_cluster++;
-                        *_fat16++ = kFat16EOC;
-                        write_dir(writer, entry._content._dir);
+                        mark_all(child._content._dir);
                     }
                     else
                     {
-                        // file
-                        const auto num_clusters = (entry._content._file->_size + (_bytes_per_cluster - 1)) / _bytes_per_cluster;
-                        entry._content._file->_start_cluster = _next_free_cluster++;
-
-                        if (_verbose)
-                        {
-                            std::cout << "\t" << num_clusters << " cluster chain for " << name << ":\n\t >" << entry._content._file->_start_cluster << "-";
-                        }
-
-                        if (num_clusters > 1)
-                        {
-                            for (auto n = 0u; n < (num_clusters - 1); ++n)
-                            {
-                                if (_verbose)
-                                {
-                                    std::cout << _next_free_cluster << "-";
-                                }
-
-                                *_fat16++ = _next_free_cluster++;
-                                check_need_new_sector(writer);
-                            }
-
-                            if (_verbose)
-                            {
-                                std::cout << "x[" << _next_free_cluster-1 << "]";
-                            }
-
-                            *_fat16++ = kFat16EOC;
-                        }
-                        else
-                        {
-                            if (_verbose)
-                            {
-                                std::cout << "x[" << _next_free_cluster-1 << "]";
-                            }
-                            
-                            *_fat16++ = kFat16EOC;
-                        }
-
-                        if (_verbose)
-                        {
-                            std::cout << std::endl;
-                        }
+                        child._content._file->_hot = true;
                     }
-
-                    check_need_new_sector(writer);
                 }
             };
-        };
-
-        void write_fat16(disk_sector_writer_t* writer, fat_boot_sector_t& boot_sector, const fs_t& fs)
+            mark_all(entry->_content._dir);
+        }
+        else
         {
-            auto* sector = writer->blank_sector();
+            entry->_content._file->_hot = true;
+        }
+        for (; parent; parent = parent->_parent)
+        {
+            parent->_hot = true;
+        }
+        return true;
+    }
 
-            write_fat16_context_t ctx;
-            ctx._fat16 = reinterpret_cast<uint16_t*>(sector);
-            ctx._fat16_end = ctx._fat16 + write_fat16_context_t::kMaxClustersPerFat16Sector;
-            ctx._bytes_per_cluster = boot_sector._bpb._sectors_per_cluster * kSectorSizeBytes;
-            ctx._entries_per_cluster = ctx._bytes_per_cluster / sizeof(fat_dir_entry_t);
+    std::string_view fs_t::child_path(const dir_t* parent, std::string_view name)
+    {
+        if (parent->_path.empty())
+        {
+            return { store_string(name), name.size() };
+        }
 
-            ctx._fat_sector = boot_sector._bpb._reserved_sectors;
-            ctx._next_free_cluster = 2;
+        const auto size = parent->_path.size() + 1 + name.size();
+        auto* path = allocate_storage(size);
+        memcpy(path, parent->_path.data(), parent->_path.size());
+        path[parent->_path.size()] = '/';
+        memcpy(path + parent->_path.size() + 1, name.data(), name.size());
+        return { path, size };
+    }
 
-            // fixed entries 0 and 1
-            *ctx._fat16++ = 0xff00 | boot_sector._bpb._media_descriptor;
-            *ctx._fat16++ = kFat16EOC;
+    System::status_or_t<bool> fs_t::create_from_manifest(std::string_view manifestPath)
+    {
+        std::ifstream ifs{ std::string{manifestPath}, std::ios::binary };
+        if (!ifs.is_open())
+        {
+            return System::Code::NOT_FOUND;
+        }
 
-            // recurse the directories and files
-            //TODO: error handling
-            ctx.write_dir(writer, &fs._root);
+        ifs.seekg(0, std::ios::end);
+        const auto size = size_t(ifs.tellg());
+        ifs.seekg(0, std::ios::beg);
 
-            if (size_t(ctx._fat16_end - ctx._fat16) < write_fat16_context_t::kMaxClustersPerFat16Sector)
-            {
-                // flush last fat sector
-                writer->write_sector();
-            }
+        //NOTE: the manifest is kept for the lifetime of this fs_t; source paths are terminated in place and referenced directly
+        auto* manifest = allocate_storage(size + 1);
+        if (!ifs.read(manifest, size))
+        {
+            return System::Code::UNAVAILABLE;
         }
+        manifest[size] = 0;
 
-        using cluster_to_lba_func_t = std::function<size_t(size_t)>;
+        const auto report_error = [](size_t line_number, const char* what, std::string_view detail) {
+            std::cerr << "*error: manifest line " << line_number << ": " << what << " " << detail << "\n";
+        };
 
+        // consecutive lines usually target the same directory so we avoid walking the tree for each one
+        std::string_view last_dir_path;
+        dir_t* last_dir = &_root;
 
-        void write_file(disk_sector_writer_t* writer, cluster_to_lba_func_t cluster_to_lba, const fs_t::dir_entry_t& entry)
+        const auto* manifest_end = manifest + size;
+        size_t line_number = 0;
+        for (auto* line = manifest; line < manifest_end;)
         {
-            // the contents of a file are laid out in a linear chain starting at 
-            // the start cluster, here we just copy it in sector by sector
-            auto file_sector = cluster_to_lba(entry._content._file->_start_cluster);
-            auto bytes_left = static_cast<long long>(entry._content._file->_size);
-            const auto* bytes = static_cast<const char*>(entry._content._file->_data);
-
-            writer->seek_from_beg(file_sector);
-
-            if (_verbose)
+            auto* eol = static_cast<char*>(memchr(line, '\n', size_t(manifest_end - line)));
+            if (!eol)
             {
-                std::cout << "\tfile of " << bytes_left << " bytes starts at cluster " << entry._content._file->_start_cluster << ", sectors [" << file_sector;
+                eol = manifest + size;
             }
-
-            do
+            auto* next_line = eol + 1;
+            *eol = 0;
+            ++line_number;
+            if (eol > line && eol[-1] == '\r')
             {
-                memcpy(writer->blank_sector(), bytes, kSectorSizeBytes);
-                writer->write_sector();
-                ++file_sector;
-                bytes += kSectorSizeBytes;
-                bytes_left -= kSectorSizeBytes;
-            } while (bytes_left >= static_cast<long long>(kSectorSizeBytes));
+                *--eol = 0;
+            }
 
-            if (bytes_left > 0)
+            if (line == eol || line[0] == '#')
             {
-                memcpy(writer->blank_sector(), bytes, bytes_left);
-                writer->write_sector();
-                ++file_sector;
+                line = next_line;
+                continue;
             }
 
-            if (_verbose)
+            auto* tab = static_cast<char*>(memchr(line, '\t', size_t(eol - line)));
+            if (!tab)
             {
-                const auto sectors_used = (file_sector - cluster_to_lba(entry._content._file->_start_cluster));
-                const auto clusters_used = (sectors_used + 3)/4;
-                std::cout << ", " << file_sector << ">, " << clusters_used << " clusters" << std::endl;
+                report_error(line_number, "expected <source>\\t<destination>, got", line);
+                return System::Code::INVALID_ARGUMENT;
             }
-        }
-
-        void write_dir(disk_sector_writer_t* writer, cluster_to_lba_func_t cluster_to_lba, const fs_t::dir_entry_t& entry_)
-        {
-            auto* dir_entry = reinterpret_cast<fat_dir_entry_t*>(writer->blank_sector());
-
-            // add standard "." and ".." entries
-            dir_entry->set_name(".");
-            dir_entry->_attrib = uint8_t(fat_file_attribute::kDirectory);
-            dir_entry->_first_cluster_lo = entry_._content._dir->_start_cluster;
-            dir_entry++;
-            dir_entry->set_name("..");
-            dir_entry->_attrib = uint8_t(fat_file_attribute::kDirectory);
-            dir_entry->_first_cluster_lo = entry_._content._dir->_parent->_start_cluster;
-            dir_entry++;
+            *tab = 0;
+            const char* source_path = line;
+            std::string_view dest{ tab + 1, size_t(eol - (tab + 1)) };
+            const auto dest_start = dest.find_first_not_of("/\\");
+            dest = dest_start == std::string_view::npos ? std::string_view{} : dest.substr(dest_start);
+            while (!dest.empty() && (dest.back() == '/' || dest.back() == '\\'))
+            {
+                dest.remove_suffix(1);
+            }
+            line = next_line;
 
-            const auto entries = entry_._content._dir->_entries;
-            for (auto& [name, entry] : entries)
+            if (dest.empty())
             {
-                dir_entry->set_name(name.c_str());
-                if (entry._is_dir)
-                {
-                    dir_entry->_attrib = uint8_t(fat_file_attribute::kDirectory);
-                    dir_entry->_first_cluster_lo = entry._content._dir->_start_cluster;
+                report_error(line_number, "missing destination for", source_path);
+                return System::Code::INVALID_ARGUMENT;
+            }
 
-                    if (_verbose)
-                    {
-                        std::cout << "\t\tadded directory \"" << name << "\", starting at cluster " << dir_entry->_first_cluster_lo << "\n";
-                    }
-                }
-                else
+            if (!source_path[0])
+            {
+                // directory entry
+                const auto dir_result = create_directories(&_root, dest);
+                if (!dir_result)
                 {
-                    dir_entry->_size = entry._content._file->_size;
-                    dir_entry->_first_cluster_lo = entry._content._file->_start_cluster;
-
-                    if (_verbose)
-                    {
-                        std::cout << "\t\tadded file \"" << name << "\", " << dir_entry->_size << " bytes, starting at cluster " << dir_entry->_first_cluster_lo << "\n";
-                    }
+                    report_error(line_number, "can't create directory", dest);
+                    return dir_result.error_code();
                 }
-                ++dir_entry;
+                continue;
             }
-            writer->seek_from_beg(cluster_to_lba(entry_._content._dir->_start_cluster));
-            writer->write_sector();
 
-            // now recurse...
-            //NOTE: having to do this and not [name, entry] is down to some internal ms build 142 compiler issue which I have no intent on tracking down
-            for (auto i : entries)
+            const auto name_start = dest.find_last_of("/\\");
+            const auto dir_path = name_start == std::string_view::npos ? std::string_view{} : dest.substr(0, name_start);
+            const auto name = name_start == std::string_view::npos ? dest : dest.substr(name_start + 1);
+            if (dir_path != last_dir_path)
             {
-                if (i.second._is_dir)
+                const auto dir_result = create_directories(&_root, dir_path);
+                if (!dir_result)
                 {
-                    write_dir(writer, cluster_to_lba, i.second);
-                }
-                else
-                {
-                    write_file(writer, cluster_to_lba, i.second);
+                    report_error(line_number, "can't create directory", dir_path);
+                    return dir_result.error_code();
                 }
+                last_dir = dir_result.value();
+                last_dir_path = dir_path;
             }
-        }
 
-        System::status_or_t<bool> write_fs_contents_to_disk(disk_sector_writer_t* writer, size_t root_dir_start_lba,
-            size_t first_data_lba, size_t sectors_per_cluster,
-            const char* volumeLabel, const fs_t& fs)
-        {
-            const auto cluster_to_lba = [=](size_t cluster) -> size_t {
-                return first_data_lba + ((cluster - 2) * sectors_per_cluster);
-            };
-
-            // the first entry is always the volume label entry (which must match the volume label set in the BPB)
-            auto* dir_entry = reinterpret_cast<fat_dir_entry_t*>(writer->blank_sector());
-            dir_entry->set_name(volumeLabel);
-            dir_entry->_attrib = uint8_t(fat_file_attribute::kVolumeId);
-            ++dir_entry;
-
-            if (_verbose)
+            std::error_code ec;
+            const auto file_size = fs::file_size(source_path, ec);
+            if (ec)
             {
-                std::cout << "\tvolume label \"" << volumeLabel << "\"\n";
+                report_error(line_number, "can't read", source_path);
+                return System::Code::NOT_FOUND;
             }
 
-            // the root directory (for either FAT16 or FAT32) is special and has no '.' or '..' entries
-            //TODO:ZZZ: check for overrun
-            for (auto& [name, entry] : fs._root._entries)
+            const auto file_result = create_file_from_source(last_dir, name, source_path, size_t(file_size));
+            if (!file_result)
             {
-                dir_entry->set_name(name.c_str());
-                if (entry._is_dir)
-                {
-                    dir_entry->_attrib = uint8_t(fat_file_attribute::kDirectory);
-                    dir_entry->_first_cluster_lo = entry._content._dir->_start_cluster;
+                report_error(line_number, "can't create file", dest);
+                return file_result.error_code();
+            }
+        }
 
-                    if (_verbose)
+        return true;
+    }
+
+    // sequential reader for archives, from a file or from stdin ("-"). stdin can't seek so skipping means reading
+    struct archive_stream_t
+    {
+        bool open(std::string_view path)
+        {
+            _from_stdin = path == "-";
+            if (_from_stdin)
+            {
+                xset_stdin_binary();
+                _is = &std::cin;
+                return true;
+            }
+            _ifs.open(std::string{ path }, std::ios::binary);
+            _is = &_ifs;
+            return _ifs.is_open();
+        }
+
+        bool read(void* buffer, uint64_t size)
+        {
+            _is->read(static_cast<char*>(buffer), std::streamsize(size));
+            _offset += uint64_t(_is->gcount());
+            return _is->good();
+        }
+
+        bool skip(uint64_t size)
+        {
+            if (_from_stdin)
+            {
+                _is->ignore(std::streamsize(size));
+            }
+            else
+            {
+                _is->seekg(std::streamoff(size), std::ios::cur);
+            }
+            _offset += size;
+            return _is->good();
+        }
+
+        // copy the next size bytes to spool, a chunk at a time so only that much is ever held in memory, and return where in spool they are. 
+        // DATA_LOSS if the archive ends first, UNAVAILABLE if spool can't be written
+        System::status_or_t<uint64_t> spool(fs_t::spool_file_t& spool, uint64_t size)
+        {
+            static constexpr uint64_t kSpoolChunkBytes = 1024 * 1024;
+            if (!_chunk)
+            {
+                _chunk.reset(new char[kSpoolChunkBytes]);
+            }
+            const auto offset = spool._size;
+            for (uint64_t consumed = 0; consumed < size; )
+            {
+                const auto chunk = std::min(size - consumed, kSpoolChunkBytes);
+                if (!read(_chunk.get(), chunk))
+                {
+                    return System::Code::DATA_LOSS;
+                }
+                if (!spool.append(_chunk.get(), size_t(chunk)))
+                {
+                    return System::Code::UNAVAILABLE;
+                }
+                consumed += chunk;
+            }
+            return offset;
+        }
+
+        bool at_eof() const
+        {
+            return _is->eof();
+        }
+
+        // paths in archives are relative, frequently start with "./", and directories may end with '/'. "./EFI/BOOT/" -> "EFI/BOOT"
+        static std::string_view relative_path(std::string_view path)
+        {
+            while (!path.empty() && (path[0] == '/' || path.substr(0, 2) == "./"))
+            {
+                path.remove_prefix(path[0] == '/' ? 1 : 2);
+            }
+            while (!path.empty() && path.back() == '/')
+            {
+                path.remove_suffix(1);
+            }
+            return path;
+        }
+
+        std::ifstream   _ifs;
+        std::istream*   _is = nullptr;
+        bool            _from_stdin = false;
+        // offset of the next byte to be read
+        uint64_t        _offset = 0;
+        // see spool
+        std::unique_ptr<char[]> _chunk;
+    };
+
+    namespace tar
+    {
+        // numeric fields are octal text terminated by NUL or space, or big-endian base-256 if the high bit is set (GNU, star)
+        uint64_t parse_number(const char* field, size_t size)
+        {
+            const auto* bytes = reinterpret_cast<const uint8_t*>(field);
+            uint64_t value = 0;
+            if (bytes[0] & 0x80)
+            {
+                value = bytes[0] & 0x7f;
+                for (auto n = 1u; n < size; ++n)
+                {
+                    value = (value << 8) | bytes[n];
+                }
+                return value;
+            }
+
+            auto n = 0u;
+            while (n < size && field[n] == ' ')
+            {
+                ++n;
+            }
+            for (; n < size && field[n] >= '0' && field[n] <= '7'; ++n)
+            {
+                value = (value << 3) | uint64_t(field[n] - '0');
+            }
+            return value;
+        }
+
+        bool is_end_of_archive(const ustar_header_t& header)
+        {
+            const auto* bytes = reinterpret_cast<const uint8_t*>(&header);
+            return std::all_of(bytes, bytes + kBlockSizeBytes, [](uint8_t b) { return b == 0; });
+        }
+
+        bool checksum_valid(const ustar_header_t& header)
+        {
+            const auto* bytes = reinterpret_cast<const uint8_t*>(&header);
+            uint64_t sum = 0;
+            for (auto n = 0u; n < kBlockSizeBytes; ++n)
+            {
+                sum += bytes[n];
+            }
+            // the checksum field itself is summed as if it were all spaces
+            for (auto c : header._chksum)
+            {
+                sum = sum - uint8_t(c) + uint8_t(' ');
+            }
+            return sum == parse_number(header._chksum, sizeof header._chksum);
+        }
+
+        // pax extended header records are "<length> <key>=<value>\n", we only care about path, linkpath, and size
+        void parse_pax_records(std::string_view records, std::string& path, std::string& link_path, uint64_t& size, bool& has_size)
+        {
+            while (!records.empty())
+            {
+                size_t length = 0;
+                auto n = 0u;
+                for (; n < records.size() && records[n] >= '0' && records[n] <= '9'; ++n)
+                {
+                    length = length * 10 + size_t(records[n] - '0');
+                }
+                if (n == records.size() || records[n] != ' ' || length <= n + 1 || length > records.size())
+                {
+                    // malformed, ignore the rest
+                    return;
+                }
+
+                // excluding the terminating newline
+                const auto record = records.substr(n + 1, length - n - 2);
+                records.remove_prefix(length);
+
+                const auto eq = record.find('=');
+                if (eq == std::string_view::npos)
+                {
+                    continue;
+                }
+                const auto key = record.substr(0, eq);
+                const auto value = record.substr(eq + 1);
+                if (key == "path")
+                {
+                    path = value;
+                }
+                else if (key == "linkpath")
+                {
+                    link_path = value;
+                }
+                else if (key == "size")
+                {
+                    size = 0;
+                    for (auto c : value)
+                    {
+                        size = size * 10 + uint64_t(c - '0');
+                    }
+                    has_size = true;
+                }
+            }
+        }
+
+    }
+
+    System::status_or_t<bool> fs_t::create_from_tar(std::string_view tarPath)
+    {
+        archive_stream_t archive;
+        if (!archive.open(tarPath))
+        {
+            return System::Code::NOT_FOUND;
+        }
+        // files in a seekable archive are streamed from it when the image is written, otherwise they are spooled to a temporary file first
+        const char* source_path = archive._from_stdin ? nullptr : store_string(tarPath);
+
+        const auto report_error = [](const char* what, std::string_view detail) {
+            std::cerr << "*error: tar: " << what << " " << detail << "\n";
+        };
+
+        // extended headers and long names are small, anything bigger than this is considered broken
+        static constexpr uint64_t kMaxExtendedHeaderBytes = 1024 * 1024;
+
+        tar::ustar_header_t header;
+        // a name, link name, and size from a preceeding pax or GNU long name header applies to the next entry only
+        std::string extended_path;
+        std::string extended_link_path;
+        std::string extended_header;
+        uint64_t extended_size = 0;
+        bool has_extended_size = false;
+        std::string header_path;
+
+        for (;;)
+        {
+            const auto header_offset = archive._offset;
+            if (!archive.read(&header, sizeof header))
+            {
+                // a missing end-of-archive marker is tolerated, a truncated header isn't
+                if (archive._offset == header_offset && archive.at_eof())
+                {
+                    break;
+                }
+                report_error("truncated archive", tarPath);
+                return System::Code::DATA_LOSS;
+            }
+
+            if (tar::is_end_of_archive(header))
+            {
+                break;
+            }
+            if (!tar::checksum_valid(header))
+            {
+                report_error("invalid header checksum at offset", std::to_string(header_offset));
+                return System::Code::INVALID_ARGUMENT;
+            }
+
+            const auto type = tar::type_flag(header._typeflag);
+            const auto size = has_extended_size ? extended_size : tar::parse_number(header._size, sizeof header._size);
+            const auto padded_size = (size + (tar::kBlockSizeBytes - 1)) & ~uint64_t(tar::kBlockSizeBytes - 1);
+
+            if (type == tar::type_flag::kPaxExtended || type == tar::type_flag::kPaxGlobal ||
+                type == tar::type_flag::kGnuLongName || type == tar::type_flag::kGnuLongLink)
+            {
+                if (size > kMaxExtendedHeaderBytes)
+                {
+                    report_error("oversized extended header at offset", std::to_string(header_offset));
+                    return System::Code::INVALID_ARGUMENT;
+                }
+                extended_header.resize(size_t(size));
+                if (!archive.read(extended_header.data(), size) || !archive.skip(padded_size - size))
+                {
+                    report_error("truncated archive", tarPath);
+                    return System::Code::DATA_LOSS;
+                }
+
+                if (type == tar::type_flag::kPaxExtended)
+                {
+                    tar::parse_pax_records(extended_header, extended_path, extended_link_path, extended_size, has_extended_size);
+                }
+                else if (type == tar::type_flag::kGnuLongName)
+                {
+                    extended_path.assign(extended_header.c_str());
+                }
+                else if (type == tar::type_flag::kGnuLongLink)
+                {
+                    extended_link_path.assign(extended_header.c_str());
+                }
+                //NOTE: global pax headers are of no interest to us
+                continue;
+            }
+
+            if (extended_path.empty())
+            {
+                header_path.clear();
+                // only POSIX ustar uses the prefix field, older GNU archives store other things there
+                if (memcmp(header._magic, "ustar", 6) == 0 && header._prefix[0])
+                {
+                    header_path.append(header._prefix, strnlen(header._prefix, sizeof header._prefix)).append("/");
+                }
+                header_path.append(header._name, strnlen(header._name, sizeof header._name));
+            }
+            const auto path = archive_stream_t::relative_path(extended_path.empty() ? std::string_view{ header_path } : std::string_view{ extended_path });
+
+            const auto data_offset = archive._offset;
+            auto status = System::status_t{};
+            if (type == tar::type_flag::kDirectory)
+            {
+                if (path.size() && path != ".")
+                {
+                    const auto dir_result = create_directories(&_root, path);
+                    status = dir_result ? System::Code::OK : dir_result.error_code();
+                }
+            }
+            else if (type == tar::type_flag::kRegular || type == tar::type_flag::kRegularOld || type == tar::type_flag::kContiguous)
+            {
+                const auto name_start = path.find_last_of('/');
+                const auto dir_result = create_directories(&_root, name_start == std::string_view::npos ? std::string_view{} : path.substr(0, name_start));
+                const auto* file_source_path = source_path;
+                auto file_offset = data_offset;
+                // an empty file has nothing to spool, and no source (see hash_file)
+                if (dir_result && archive._from_stdin && size)
+                {
+                    const auto spool_result = archive.spool(_spool, size);
+                    if (!spool_result)
                     {
-                        std::cout << "\tadded directory \"" << name << "\", starting at cluster " << dir_entry->_first_cluster_lo << "\n";
+                        report_error(spool_result.error_code() == System::Code::DATA_LOSS ? "truncated archive" : "can't write a temporary copy of", tarPath);
+                        return spool_result.error_code();
                     }
+                    file_source_path = _spool._path.c_str();
+                    file_offset = spool_result.value();
+                }
+
+                if (!dir_result)
+                {
+                    status = dir_result.error_code();
                 }
                 else
                 {
-                    dir_entry->_size = entry._content._file->_size;
-                    dir_entry->_first_cluster_lo = entry._content._file->_start_cluster;
+                    const auto file_result = insert_file(dir_result.value(), name_start == std::string_view::npos ? path : path.substr(name_start + 1),
+                        nullptr, file_source_path, size_t(size));
+                    if (file_result)
+                    {
+                        file_result.value()->_source_offset = size_t(file_offset);
+                    }
+                    status = file_result ? System::Code::OK : file_result.error_code();
+                }
+            }
+            else if (type == tar::type_flag::kHardLink)
+            {
+                // another name for a file earlier in the archive (GNU tar stores all but the first name of a file this way), 
+                // which shares its contents
+                std::string link_path{ archive_stream_t::relative_path(extended_link_path.empty() 
+                    ? std::string_view{ header._linkname, strnlen(header._linkname, sizeof header._linkname) } : std::string_view{ extended_link_path }) };
+                const auto target = _index.find(std::string_view{ normalise_case(link_path) });
+                if (target == _index.end() || target->second._is_dir)
+                {
+                    report_error("hard link to a file that isn't in the archive", path);
+                    return System::Code::INVALID_ARGUMENT;
+                }
+                const auto* linked = target->second._content._file;
 
-                    if (_verbose)
+                const auto name_start = path.find_last_of('/');
+                const auto dir_result = create_directories(&_root, name_start == std::string_view::npos ? std::string_view{} : path.substr(0, name_start));
+                if (!dir_result)
+                {
+                    status = dir_result.error_code();
+                }
+                else
+                {
+                    const auto file_result = insert_file(dir_result.value(), name_start == std::string_view::npos ? path : path.substr(name_start + 1),
+                        linked->_data, linked->_source_path, linked->_size);
+                    if (file_result)
                     {
-                        std::cout << "\tadded file \"" << name << "\", " << dir_entry->_size << " bytes, starting at cluster " << dir_entry->_first_cluster_lo << "\n";
+                        file_result.value()->_source_offset = linked->_source_offset;
                     }
+                    status = file_result ? System::Code::OK : file_result.error_code();
                 }
-                ++dir_entry;
+            }
+            else
+            {
+                std::cerr << "*warning: tar: skipping \"" << path << "\", symbolic links and special files are not supported\n";
             }
 
-            writer->seek_from_beg(root_dir_start_lba);
-            writer->write_sector();
+            if (!status)
+            {
+                report_error("can't add", path);
+                return status.error_code();
+            }
 
-            // remaining file system contents
-            for (auto& [name, entry] : fs._root._entries)
+            if (!archive.skip(padded_size - (archive._offset - data_offset)))
             {
-                if (entry._is_dir)
+                report_error("truncated archive", tarPath);
+                return System::Code::DATA_LOSS;
+            }
+
+            extended_path.clear();
+            extended_link_path.clear();
+            has_extended_size = false;
+        }
+
+        return true;
+    }
+
+    namespace cpio
+    {
+        uint32_t parse_hex(const char (&field)[8])
+        {
+            uint32_t value = 0;
+            for (auto c : field)
+            {
+                const auto digit = c >= '0' && c <= '9' ? c - '0' : (c | 0x20) - 'a' + 10;
+                value = (value << 4) | uint32_t(digit & 0xf);
+            }
+            return value;
+        }
+
+        constexpr uint64_t padding(uint64_t size)
+        {
+            return (kAlignment - (size % kAlignment)) % kAlignment;
+        }
+    }
+
+    System::status_or_t<bool> fs_t::create_from_cpio(std::string_view cpioPath)
+    {
+        archive_stream_t archive;
+        if (!archive.open(cpioPath))
+        {
+            return System::Code::NOT_FOUND;
+        }
+        const char* source_path = archive._from_stdin ? nullptr : store_string(cpioPath);
+
+        const auto report_error = [](const char* what, std::string_view detail) {
+            std::cerr << "*error: cpio: " << what << " " << detail << "\n";
+        };
+
+        // newc stores the data of hard linked files with the *last* link only, the others have size 0
+        // so we keep track of them to give them the data when it turns up
+        struct link_key_t
+        {
+            uint32_t _devmajor;
+            uint32_t _devminor;
+            uint32_t _ino;
+            bool operator<(const link_key_t& rhs) const
+            {
+                return std::tie(_devmajor, _devminor, _ino) < std::tie(rhs._devmajor, rhs._devminor, rhs._ino);
+            }
+        };
+        std::map<link_key_t, std::vector<file_t*>> pending_links;
+
+        cpio::newc_header_t header;
+        //NOTE: the name buffer is reused for all entries
+        std::string name_buffer;
+        for (;;)
+        {
+            const auto header_offset = archive._offset;
+            if (!archive.read(&header, sizeof header))
+            {
+                report_error("truncated archive", cpioPath);
+                return System::Code::DATA_LOSS;
+            }
+            if (memcmp(header._magic, cpio::kNewcMagic, sizeof header._magic) != 0 &&
+                memcmp(header._magic, cpio::kNewcCrcMagic, sizeof header._magic) != 0)
+            {
+                report_error("not a newc header at offset", std::to_string(header_offset));
+                return System::Code::INVALID_ARGUMENT;
+            }
+
+            const auto name_size = cpio::parse_hex(header._namesize);
+            const auto size = uint64_t(cpio::parse_hex(header._filesize));
+            const auto mode = cpio::parse_hex(header._mode);
+            name_buffer.resize(name_size);
+            if (!name_size || !archive.read(name_buffer.data(), name_size) || !archive.skip(cpio::padding(sizeof header + name_size)))
+            {
+                report_error("truncated archive", cpioPath);
+                return System::Code::DATA_LOSS;
+            }
+
+            if (std::string_view{ name_buffer.c_str() } == cpio::kTrailerName)
+            {
+                break;
+            }
+            const auto path = archive_stream_t::relative_path(name_buffer.c_str());
+
+            const auto data_offset = archive._offset;
+            auto status = System::status_t{};
+            if ((mode & cpio::kModeTypeMask) == cpio::kModeDirectory)
+            {
+                if (path.size() && path != ".")
+                {
+                    const auto dir_result = create_directories(&_root, path);
+                    status = dir_result ? System::Code::OK : dir_result.error_code();
+                }
+            }
+            else if ((mode & cpio::kModeTypeMask) == cpio::kModeRegular)
+            {
+                const auto name_start = path.find_last_of('/');
+                const auto dir_result = create_directories(&_root, name_start == std::string_view::npos ? std::string_view{} : path.substr(0, name_start));
+                const auto* file_source_path = source_path;
+                auto file_offset = data_offset;
+                if (dir_result && archive._from_stdin && size)
+                {
+                    const auto spool_result = archive.spool(_spool, size);
+                    if (!spool_result)
+                    {
+                        report_error(spool_result.error_code() == System::Code::DATA_LOSS ? "truncated archive" : "can't write a temporary copy of", cpioPath);
+                        return spool_result.error_code();
+                    }
+                    file_source_path = _spool._path.c_str();
+                    file_offset = spool_result.value();
+                }
+
+                if (!dir_result)
                 {
-                    write_dir(writer, cluster_to_lba, entry);
+                    status = dir_result.error_code();
                 }
                 else
                 {
-                    write_file(writer, cluster_to_lba, entry);
+                    const auto file_result = insert_file(dir_result.value(), name_start == std::string_view::npos ? path : path.substr(name_start + 1),
+                        nullptr, file_source_path, size_t(size));
+                    status = file_result ? System::Code::OK : file_result.error_code();
+                    if (file_result)
+                    {
+                        auto* file = file_result.value();
+                        file->_source_offset = size_t(file_offset);
+
+                        if (cpio::parse_hex(header._nlink) > 1)
+                        {
+                            auto& links = pending_links[link_key_t{ cpio::parse_hex(header._devmajor), cpio::parse_hex(header._devminor), cpio::parse_hex(header._ino) }];
+                            if (size)
+                            {
+                                for (auto* link : links)
+                                {
+                                    link->_data = file->_data;
+                                    link->_source_path = file->_source_path;
+                                    link->_source_offset = file->_source_offset;
+                                    link->_size = file->_size;
+                                    _size += file->_size;
+                                }
+                                links.clear();
+                            }
+                            else
+                            {
+                                links.push_back(file);
+                            }
+                        }
+                    }
+                }
+            }
+            else
+            {
+                std::cerr << "*warning: cpio: skipping \"" << path << "\", symbolic links and special files are not supported\n";
+            }
+
+            if (!status)
+            {
+                report_error("can't add", path);
+                return status.error_code();
+            }
+
+            if (!archive.skip(size + cpio::padding(size) - (archive._offset - data_offset)))
+            {
+                report_error("truncated archive", cpioPath);
+                return System::Code::DATA_LOSS;
+            }
+        }
+
+        return true;
+    }
+
+    fs_t::spool_file_t::~spool_file_t()
+    {
+        if (_file)
+        {
+            std::fclose(_file);
+#ifdef _WIN32
+            // an open file can't be removed on Windows, so it has been kept until now
+            std::remove(_path.c_str());
+#endif
+        }
+    }
+
+    bool fs_t::spool_file_t::append(const char* data, size_t size)
+    {
+        if (!_file)
+        {
+#ifdef _WIN32
+            std::random_device random;
+            _path = (fs::temp_directory_path() / ("efibootgen-" + std::to_string(random()) + ".spool")).string();
+            _file = std::fopen(_path.c_str(), "w+b");
+#else
+            // unlinked straight away so that nothing is left behind however we exit, files are read through /dev/fd which opens it again
+            auto name = (fs::temp_directory_path() / "efibootgen-XXXXXX").string();
+            const auto fd = ::mkstemp(name.data());
+            if (fd < 0)
+            {
+                return false;
+            }
+            ::unlink(name.c_str());
+            _file = ::fdopen(fd, "w+b");
+            if (!_file)
+            {
+                ::close(fd);
+                return false;
+            }
+            _path = "/dev/fd/" + std::to_string(fd);
+#endif
+            if (!_file)
+            {
+                return false;
+            }
+        }
+        // flushed as it is written, since files are read from it through a stream of their own
+        if (std::fwrite(data, 1, size, _file) != size || std::fflush(_file) != 0)
+        {
+            return false;
+        }
+        _size += size;
+        return true;
+    }
+
+    char* fs_t::allocate_storage(size_t size)
+    {
+        static constexpr size_t kStorageChunkBytes = 1024 * 1024;
+        if (size > kStorageChunkBytes / 4)
+        {
+            // large allocations get their own buffer
+            return _storage.emplace_back(new char[size]).get();
+        }
+        if (size > _storage_left)
+        {
+            _storage_next = _storage.emplace_back(new char[kStorageChunkBytes]).get();
+            _storage_left = kStorageChunkBytes;
+        }
+        auto* storage = _storage_next;
+        _storage_next += size;
+        _storage_left -= size;
+        return storage;
+    }
+
+    const char* fs_t::store_string(std::string_view str)
+    {
+        auto* storage = allocate_storage(str.size() + 1);
+        memcpy(storage, str.data(), str.size());
+        storage[str.size()] = 0;
+        return storage;
+    }
+
+    System::status_or_t<fs_t::dir_t*> fs_t::create_directories(dir_t* parent, std::string_view path)
+    {
+        // convert to the form used by the index; "efi\\boot//" -> "EFI/BOOT"
+        std::string full_path{ parent->_path };
+        for (size_t start = 0; start < path.size();)
+        {
+            const auto end = std::min(path.find_first_of("/\\", start), path.size());
+            if (end > start)
+            {
+                if (!full_path.empty())
+                {
+                    full_path.push_back('/');
+                }
+                full_path.append(path.substr(start, end - start));
+            }
+            start = end + 1;
+        }
+        return create_indexed_directories(normalise_case(full_path));
+    }
+
+    System::status_or_t<fs_t::dir_t*> fs_t::create_indexed_directories(std::string_view path)
+    {
+        if (path.empty())
+        {
+            return &_root;
+        }
+
+        // typically the whole path, or all but the last part of it, already exists so this is one or two lookups
+        const auto i = _index.find(path);
+        if (i != _index.end())
+        {
+            if (!i->second._is_dir)
+            {
+                return System::Code::ALREADY_EXISTS;
+            }
+            return i->second._content._dir;
+        }
+
+        const auto name_start = path.find_last_of('/');
+        const auto parent_result = create_indexed_directories(name_start == std::string_view::npos ? std::string_view{} : path.substr(0, name_start));
+        if (!parent_result)
+        {
+            return parent_result;
+        }
+        return create_directory(parent_result.value(), std::string{ name_start == std::string_view::npos ? path : path.substr(name_start + 1) });
+    }
+
+    System::status_or_t<fs_t::dir_t*> fs_t::create_directory(dir_t* parent, std::string name_)
+    {
+        const auto path = child_path(parent, normalise_case(name_));
+        if (_index.find(path) != _index.end())
+        {
+            return System::Code::ALREADY_EXISTS;
+        }
+
+        dir_entry_t dir_entry{true};
+        dir_entry._content._dir = _dir_pool.create(&_node_resource);
+        dir_entry._content._dir->_name = std::move(name_);
+        dir_entry._content._dir->_path = path;
+        dir_entry._content._dir->_parent = parent;
+        //NOTE: an estimate, the space a directory takes depends on the number of entries in it (see fat::image_size_for)
+        _size += kSectorSizeBytes;
+
+        parent->_entries.emplace(dir_entry._content._dir->_name, dir_entry);
+        _index.emplace(path, dir_entry);
+        return dir_entry._content._dir;
+    }
+
+    System::status_or_t<fs_t::file_t*> fs_t::create_file(dir_t* parent, std::string_view name_, const void* data,
+                                                         size_t size)
+    {
+        assert(data && size);
+        return insert_file(parent, name_, data, nullptr, size);
+    }
+
+    System::status_or_t<fs_t::file_t*> fs_t::create_file_from_source(dir_t* parent, std::string_view name_, const char* source_path,
+                                                         size_t size)
+    {
+        assert(source_path);
+        return insert_file(parent, name_, nullptr, source_path, size);
+    }
+
+    System::status_or_t<fs_t::file_t*> fs_t::insert_file(dir_t* parent, std::string_view name_, const void* data,
+                                                         const char* source_path, size_t size)
+    {
+        auto& name = normalise_case(_name_buffer.assign(name_));
+        const auto path = child_path(parent, name);
+        if (_index.find(path) != _index.end())
+        {
+            return System::Code::ALREADY_EXISTS;
+        }
+
+        dir_entry_t dir_entry{false};
+        dir_entry._content._file = _file_pool.create();
+        dir_entry._content._file->_parent = parent;
+        dir_entry._content._file->_path = path;
+        dir_entry._content._file->_data = data;
+        dir_entry._content._file->_source_path = source_path;
+        dir_entry._content._file->_size = size;
+        _size += size;
+
+        //NOTE: index by NAME not source path
+        parent->_entries.emplace(name, dir_entry);
+        _index.emplace(path, dir_entry);
+
+        return dir_entry._content._file;
+    }
+
+    void fs_t::stat_sources()
+    {
+        // archives are the source of many files (sharing the same stored path), so only stat each source once
+        std::unordered_map<const char*, int64_t> mtimes;
+        for (auto& [path, entry] : _index)
+        {
+            if (entry._is_dir || !entry._content._file->_source_path)
+            {
+                continue;
+            }
+            auto* file = entry._content._file;
+            auto [i, inserted] = mtimes.try_emplace(file->_source_path, 0);
+            if (inserted)
+            {
+                std::error_code ec;
+                const auto mtime = fs::last_write_time(file->_source_path, ec);
+                // 0 means "unknown", which makes the update compare contents instead
+                i->second = ec ? 0 : int64_t(mtime.time_since_epoch().count());
+            }
+            file->_mtime = i->second;
+        }
+    }
+
+    void fs_t::map_sparse_sources()
+    {
+        size_t sparse_files = 0;
+        size_t hole_bytes = 0;
+        for (auto& [path, entry] : _index)
+        {
+            auto* file = entry._is_dir ? nullptr : entry._content._file;
+            if (!file || !map_sparse_source(file))
+            {
+                continue;
+            }
+
+            ++sparse_files;
+            hole_bytes += file->_size;
+            for (size_t n = 0; n < file->_extent_count; ++n)
+            {
+                hole_bytes -= file->_extents[n]._size;
+            }
+        }
+
+        if (_verbose && sparse_files)
+        {
+            std::cout << "\t" << sparse_files << " sparse source files with " << hole_bytes << " bytes of holes\n";
+        }
+    }
+
+    bool fs_t::map_sparse_source(file_t* file)
+    {
+        file->_extents = nullptr;
+        file->_extent_count = 0;
+#ifdef SEEK_HOLE
+        // files inside archives are never sparse
+        if (!file->_source_path || file->_source_offset || !file->_size)
+        {
+            return false;
+        }
+
+        // only a file with fewer blocks allocated than its size can have holes, which saves opening all the others
+        struct stat st;
+        if (::stat(file->_source_path, &st) != 0 || size_t(st.st_blocks) * 512 >= file->_size)
+        {
+            return false;
+        }
+
+        const auto fd = ::open(file->_source_path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+        {
+            return false;
+        }
+        std::vector<extent_t> extents;
+        const auto end = off_t(file->_size);
+        auto data = off_t(0);
+        while (data < end && (data = lseek(fd, data, SEEK_DATA)) >= 0 && data < end)
+        {
+            auto hole = lseek(fd, data, SEEK_HOLE);
+            if (hole < 0 || hole > end)
+            {
+                hole = end;
+            }
+            extents.push_back({ size_t(data), size_t(hole - data) });
+            data = hole;
+        }
+        // SEEK_DATA fails with ENXIO when there is no more data, anything else and we just read all of it
+        const auto mapped = data >= 0 || errno == ENXIO;
+        ::close(fd);
+        if (!mapped)
+        {
+            return false;
+        }
+
+        //NOTE: a file that is all hole still gets a (non null) extent array, with nothing in it. 
+        //      one that is mapped again leaves the old array behind, until the fs_t goes
+        std::pmr::polymorphic_allocator<extent_t> allocator{ &_node_resource };
+        auto* file_extents = allocator.allocate(std::max<size_t>(1, extents.size()));
+        std::copy(extents.begin(), extents.end(), file_extents);
+        file->_extents = file_extents;
+        file->_extent_count = extents.size();
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    uint64_t fs_t::source_location(const file_t* file)
+    {
+        if (!file->_source_path)
+        {
+            return 0;
+        }
+#ifndef _WIN32
+        const auto fd = ::open(file->_source_path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+        {
+            return 0;
+        }
+        uint64_t location = 0;
+#ifdef FS_IOC_FIEMAP
+        // the physical location of the first byte of data, which for files inside archives depends on where in the archive they are
+        const auto offset = file->_source_offset + (file->_extent_count ? file->_extents[0]._offset : 0);
+        // room for one extent
+        alignas(struct fiemap) char request[sizeof(struct fiemap) + sizeof(struct fiemap_extent)] = {};
+        auto* map = reinterpret_cast<struct fiemap*>(request);
+        map->fm_start = offset;
+        map->fm_length = 1;
+        map->fm_extent_count = 1;
+        if (::ioctl(fd, FS_IOC_FIEMAP, map) == 0 && map->fm_mapped_extents == 1 &&
+            !(map->fm_extents[0].fe_flags & (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_ENCODED | FIEMAP_EXTENT_DATA_INLINE)))
+        {
+            location = map->fm_extents[0].fe_physical + (offset - map->fm_extents[0].fe_logical);
+        }
+#endif
+        struct stat st;
+        if (!location && ::fstat(fd, &st) == 0)
+        {
+            // file systems tend to allocate inodes and blocks together, so it is the next best thing
+            location = uint64_t(st.st_ino);
+        }
+        ::close(fd);
+        return location;
+#else
+        return 0;
+#endif
+    }
+
+    void fs_t::dump_contents(const dir_t* dir, int depth) const
+    {
+        if (!dir)
+            dir = &_root;
+
+        const auto pad = std::string(depth * 4, ' ');
+        for (auto const& [key, val] : dir->_entries)
+        {
+            //NOTE: setw just doesn't work, why?
+            std::cout << pad << key << (val._is_dir ? "\\" : "") << std::endl;
+            if (val._is_dir)
+            {
+                dump_contents(val._content._dir, depth + 1);
+            }
+        }
+    }
+
+    namespace fat
+    {
+        static constexpr uint8_t kFatOemName[8] = { 'j','O','S','X',' ','6','4',' ' };
+        static constexpr uint8_t kRootFolderName[11] = { 'E','F','I' };
+        // as per standard for FAT16, and used for FAT12 as well
+        static constexpr size_t kFat16RootEntryCount = 512;
+
+        namespace
+        {
+            // characters allowed in short names, besides upper case letters and digits
+            bool is_short_name_char(char c)
+            {
+                return (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || (c && strchr("!#$%&'()-@^_`{}~", c));
+            }
+
+            // name can be stored as is in a short (8.3) entry, i.e. it doesn't need a long name
+            bool is_short_name(std::string_view name)
+            {
+                const auto dot = name.find('.');
+                const auto stem = name.substr(0, dot);
+                const auto ext = dot == std::string_view::npos ? std::string_view{} : name.substr(dot + 1);
+                if (stem.empty() || stem.size() > 8 || ext.size() > 3 || (dot != std::string_view::npos && ext.empty()))
+                {
+                    return false;
+                }
+                return std::all_of(stem.begin(), stem.end(), is_short_name_char) && std::all_of(ext.begin(), ext.end(), is_short_name_char);
+            }
+
+            // long name entries needed for name, 0 if it is a short name
+            size_t lfn_entry_count(std::string_view name)
+            {
+                if (is_short_name(name))
+                {
+                    return 0;
+                }
+                char16_t long_name[kLfnMaxChars];
+                return (utils::utf8_to_utf16(name, long_name, kLfnMaxChars) + (kLfnCharsPerEntry - 1)) / kLfnCharsPerEntry;
+            }
+
+            // hands out unique short names in a directory. names that are short names already keep them, and long names get 
+            // "BASIS~N" aliases, numbered on from the last one handed out for the same basis. that way thousands of long names 
+            // that start the same don't each have to probe their way past all the others.
+            // one is reused for every directory that is written, and only allocates when it meets a bigger directory than before
+            struct short_names_t
+            {
+                // as it goes in fat_dir_entry_t::_short_name, bases are stored the same way. all 0 is a free slot
+                using name_t = std::array<uint8_t, 11>;
+
+                void reset(const fs_t::dir_t* dir)
+                {
+                    // every entry takes at most one name and one basis, and the tables are kept at most half full
+                    size_t slots = 16;
+                    while (slots < 2 * dir->_entries.size())
+                    {
+                        slots *= 2;
+                    }
+                    _taken.assign(slots, name_t{});
+                    _next_tail.assign(slots, { name_t{}, 0 });
+
+                    for (const auto& [name, entry] : dir->_entries)
+                    {
+                        if (is_short_name(name))
+                        {
+                            fat_dir_entry_t short_entry;
+                            short_entry.set_name(name.c_str());
+                            name_t short_name;
+                            memcpy(short_name.data(), short_entry._short_name, short_name.size());
+                            take(short_name);
+                        }
+                    }
+                }
+
+                // the alias for a long name, as it goes in fat_dir_entry_t::_short_name
+                void alias(std::string_view name, uint8_t* short_name)
+                {
+                    // the basis is what is left of the name in upper case without spaces and dots, anything that isn't allowed becomes '_'.
+                    // UTF-8 sequences become a single '_'
+                    const auto basis_chars = [](std::string_view part, char* basis, size_t max_chars) {
+                        size_t chars = 0;
+                        for (const auto c : part)
+                        {
+                            if (chars == max_chars)
+                            {
+                                break;
+                            }
+                            const auto byte = static_cast<uint8_t>(c);
+                            if (c == ' ' || c == '.' || (byte & 0xc0) == 0x80)
+                            {
+                                continue;
+                            }
+                            const auto upper = char(::toupper(byte));
+                            basis[chars++] = byte < 0x80 && is_short_name_char(upper) ? upper : '_';
+                        }
+                        return chars;
+                    };
+
+                    // leading dots don't start an extension
+                    const auto start = std::min(name.find_first_not_of('.'), name.size());
+                    auto dot = name.rfind('.');
+                    if (dot == std::string_view::npos || dot < start)
+                    {
+                        dot = name.size();
+                    }
+                    char stem[8];
+                    char ext[3];
+                    auto stem_chars = basis_chars(name.substr(start, dot - start), stem, sizeof stem);
+                    const auto ext_chars = dot < name.size() ? basis_chars(name.substr(dot + 1), ext, sizeof ext) : 0;
+                    if (!stem_chars)
+                    {
+                        stem[stem_chars++] = '_';
+                    }
+
+                    name_t basis;
+                    basis.fill(' ');
+                    memcpy(basis.data(), stem, stem_chars);
+                    memcpy(basis.data() + 8, ext, ext_chars);
+                    auto& tail = next_tail(basis);
+                    for (;; ++tail)
+                    {
+                        char digits[9];
+                        const auto digit_chars = size_t(snprintf(digits, sizeof digits, "~%zu", tail));
+                        const auto keep = std::min(stem_chars, 8 - digit_chars);
+                        name_t alias;
+                        alias.fill(' ');
+                        memcpy(alias.data(), stem, keep);
+                        memcpy(alias.data() + keep, digits, digit_chars);
+                        memcpy(alias.data() + 8, ext, ext_chars);
+                        if (take(alias))
+                        {
+                            memcpy(short_name, alias.data(), alias.size());
+                            ++tail;
+                            return;
+                        }
+                    }
+                }
+
+                // open addressing, the tables are never full
+                size_t slot_of(const name_t& name) const
+                {
+                    return size_t(utils::fnv1a_64(utils::kFnv1a64Basis, reinterpret_cast<const char*>(name.data()), name.size())) & (_taken.size() - 1);
+                }
+
+                // false if name was taken already
+                bool take(const name_t& name)
+                {
+                    for (auto slot = slot_of(name);; slot = (slot + 1) & (_taken.size() - 1))
+                    {
+                        if (_taken[slot] == name)
+                        {
+                            return false;
+                        }
+                        if (_taken[slot] == name_t{})
+                        {
+                            _taken[slot] = name;
+                            return true;
+                        }
+                    }
+                }
+
+                // next N to try for basis, starting at 1
+                size_t& next_tail(const name_t& basis)
+                {
+                    for (auto slot = slot_of(basis);; slot = (slot + 1) & (_next_tail.size() - 1))
+                    {
+                        auto& [key, tail] = _next_tail[slot];
+                        if (key == name_t{})
+                        {
+                            key = basis;
+                            tail = 1;
+                        }
+                        if (key == basis)
+                        {
+                            return tail;
+                        }
+                    }
+                }
+
+                std::vector<name_t>                     _taken;
+                std::vector<std::pair<name_t, size_t>>  _next_tail;
+            };
+        }
+
+        // directory entries needed for dir; the volume label in the root directory, or "." and ".." in others, and one per file or directory 
+        // plus any long name entries
+        size_t dir_entry_count(const fs_t::dir_t* dir)
+        {
+            size_t count = dir->_parent ? 2 : 1;
+            for (const auto& [name, entry] : dir->_entries)
+            {
+                count += 1 + lfn_entry_count(name);
+            }
+            return count;
+        }
+
+        size_t dir_clusters(const fs_t::dir_t* dir, size_t bytes_per_cluster)
+        {
+            return ((dir_entry_count(dir) * sizeof(fat_dir_entry_t)) + (bytes_per_cluster - 1)) / bytes_per_cluster;
+        }
+
+        namespace
+        {
+            // the first cluster from cluster on that the contents of a file can start at, see _align_bytes. 
+            //NOTE: this assumes the data area itself is aligned, which volume_layout takes care of
+            size_t aligned_cluster(size_t cluster, size_t bytes_per_cluster)
+            {
+                if (_align_bytes <= bytes_per_cluster)
+                {
+                    return cluster;
+                }
+                const auto align_clusters = _align_bytes / bytes_per_cluster;
+                return 2 + ((cluster - 2 + (align_clusters - 1)) / align_clusters) * align_clusters;
+            }
+
+            bool is_hot(const fs_t::dir_entry_t& entry)
+            {
+                return entry._is_dir ? entry._content._dir->_hot : entry._content._file->_hot;
+            }
+
+            // visit(name, entry) for the entries of dir in the order their directory entries are written, the hot ones (see fs_t::mark_hot) first
+            template<typename Visit>
+            void for_each_entry(const fs_t::dir_t* dir, Visit&& visit)
+            {
+                if (dir->_hot)
+                {
+                    for (const auto& [name, entry] : dir->_entries)
+                    {
+                        if (is_hot(entry))
+                        {
+                            visit(name, entry);
+                        }
+                    }
+                }
+                for (const auto& [name, entry] : dir->_entries)
+                {
+                    if (!dir->_hot || !is_hot(entry))
+                    {
+                        visit(name, entry);
+                    }
+                }
+            }
+
+            template<typename Visit>
+            void visit_layout(const fs_t::dir_t* dir, bool hot, Visit& visit)
+            {
+                for_each_entry(dir, [&](const auto& name, const fs_t::dir_entry_t& entry) {
+                    if (is_hot(entry) == hot)
+                    {
+                        visit(name, entry);
+                    }
+                    // hot directories can have anything in them, the others have nothing hot
+                    if (entry._is_dir && (!hot || is_hot(entry)))
+                    {
+                        visit_layout(entry._content._dir, hot, visit);
+                    }
+                });
+            }
+
+            // visit(name, entry) for everything below dir in the order it is laid out in the data area; everything hot first and then 
+            // everything else, both depth first with directories ahead of their contents. Without anything hot it is simply depth first
+            template<typename Visit>
+            void for_each_in_layout_order(const fs_t::dir_t* dir, Visit visit)
+            {
+                visit_layout(dir, true, visit);
+                visit_layout(dir, false, visit);
+            }
+
+            // clusters used by the contents of dir, as plan_fat allocates them
+            size_t count_clusters(const fs_t::dir_t* dir, size_t bytes_per_cluster)
+            {
+                size_t clusters = 0;
+                for (const auto& [name, entry] : dir->_entries)
+                {
+                    if (entry._is_dir)
+                    {
+                        clusters += dir_clusters(entry._content._dir, bytes_per_cluster) + count_clusters(entry._content._dir, bytes_per_cluster);
+                    }
+                    else
+                    {
+                        clusters += (entry._content._file->_size + (bytes_per_cluster - 1)) / bytes_per_cluster;
+                    }
+                }
+                return clusters;
+            }
+
+            // the cluster after the last one allocated for the contents of dir when they are allocated from next_cluster on, 
+            // as fat_context_t::allocate_dir does. This is next_cluster + count_clusters unless files are aligned
+            size_t allocation_end(const fs_t::dir_t* dir, size_t bytes_per_cluster, size_t next_cluster)
+            {
+                if (_align_bytes <= bytes_per_cluster)
+                {
+                    return next_cluster + count_clusters(dir, bytes_per_cluster);
+                }
+                for_each_in_layout_order(dir, [&](const auto&, const fs_t::dir_entry_t& entry) {
+                    if (entry._is_dir)
+                    {
+                        next_cluster += dir_clusters(entry._content._dir, bytes_per_cluster);
+                    }
+                    else if (entry._content._file->_size)
+                    {
+                        next_cluster = aligned_cluster(next_cluster, bytes_per_cluster) + (entry._content._file->_size + (bytes_per_cluster - 1)) / bytes_per_cluster;
+                    }
+                });
+                return next_cluster;
+            }
+        }
+
+        // call visit with the fat_traits_t for fat_bits, this is the one place that the type of FAT is picked at runtime, 
+        // whatever visit does with it is compiled for each type
+        template<typename Visit>
+        decltype(auto) with_fat_traits(unsigned fat_bits, Visit&& visit)
+        {
+            switch (fat_bits)
+            {
+            case 12:
+                return visit(fat_traits_t<12>{});
+            case 16:
+                return visit(fat_traits_t<16>{});
+            default:
+                assert(fat_bits == 32);
+                return visit(fat_traits_t<32>{});
+            }
+        }
+
+        // helper to build the FAT for files and directories in an fs_t container, in memory. 
+        // FAT12 entries are held unpacked, and packed when the FAT is planned (see pack_fat12)
+        template<typename traits_t>
+        struct fat_context_t
+        {
+            using entry_t = typename traits_t::entry_t;
+
+            // indexed by cluster, big enough for all the clusters that are allocated
+            std::vector<entry_t> _fat;
+
+            size_t          _next_free_cluster = 0;
+            size_t          _bytes_per_cluster = 0;
+
+            // a chain of num_clusters from the next free cluster on, returns the first
+            size_t allocate_chain(size_t num_clusters)
+            {
+                assert(num_clusters);
+                const auto start_cluster = _next_free_cluster;
+                // each entry points to the next cluster in the chain, i.e. they count up from start_cluster + 1, and the last one ends it
+                simd::iota(_fat.data() + start_cluster, num_clusters - 1, entry_t(start_cluster + 1));
+                _next_free_cluster += num_clusters;
+                _fat[_next_free_cluster - 1] = traits_t::kEOC;
+                return start_cluster;
+            }
+
+            // allocates FAT clusters for the directory structure from dir *depth first*, what the firmware reads at startup first
+            void allocate_dir(const fs_t::dir_t* dir)
+            {
+                for_each_in_layout_order(dir, [this](const auto& name, const fs_t::dir_entry_t& entry) {
+                    if (entry._is_dir)
+                    {
+                        entry._content._dir->_start_cluster = allocate_chain(dir_clusters(entry._content._dir, _bytes_per_cluster));
+                    }
+                    else
+                    {
+                        // file
+                        if (!entry._content._file->_size)
+                        {
+                            // empty files don't occupy any clusters
+                            entry._content._file->_start_cluster = 0;
+                            return;
+                        }
+                        const auto num_clusters = (entry._content._file->_size + (_bytes_per_cluster - 1)) / _bytes_per_cluster;
+                        // any clusters skipped to align the file are left free
+                        _next_free_cluster = aligned_cluster(_next_free_cluster, _bytes_per_cluster);
+                        entry._content._file->_start_cluster = allocate_chain(num_clusters);
+
+                        if (_verbose)
+                        {
+                            std::cout << "\t" << num_clusters << " cluster chain for " << name << ": [" << entry._content._file->_start_cluster << "-" << _next_free_cluster-1 << "]" << std::endl;
+                        }
+                    }
+                });
+            };
+        };
+
+        // FAT12 entries are 12 bits, stored as pairs in 3 bytes with the low bits of the first in the first byte. 
+        // out must have room for ((count * 3) + 1) / 2 bytes
+        void pack_fat12(const uint16_t* entries, size_t count, uint8_t* out)
+        {
+            for (; count > 1; count -= 2, entries += 2, out += 3)
+            {
+                out[0] = uint8_t(entries[0]);
+                out[1] = uint8_t(((entries[0] >> 8) & 0x0f) | (entries[1] << 4));
+                out[2] = uint8_t(entries[1] >> 4);
+            }
+            if (count)
+            {
+                out[0] = uint8_t(entries[0]);
+                out[1] = uint8_t((entries[0] >> 8) & 0x0f);
+            }
+        }
+
+        // the fixed disk media descriptor, in the boot sector and the first FAT entry
+        static constexpr uint8_t kMediaDescriptor = 0xf8;
+
+        // allocate clusters for everything in fs, in order, and build the used part of the FAT for plan. 
+        // the clusters allocated must fit in the volume
+        template<typename traits_t>
+        System::status_or_t<bool> plan_fat(plan_t& plan, const fs_t& fs)
+        {
+            using entry_t = typename traits_t::entry_t;
+            const auto& volume = plan._volume;
+
+            fat_context_t<traits_t> ctx;
+            ctx._bytes_per_cluster = volume._sectors_per_cluster * kSectorSizeBytes;
+
+            if (!traits_t::kRootDirIsChain && dir_entry_count(&fs._root) > kFat16RootEntryCount)
+            {
+                std::cerr << "*error: the root directory of a FAT" << volume._fat_bits << " volume only has room for " << kFat16RootEntryCount << " entries, it needs " << dir_entry_count(&fs._root) << " (long names take more than one)\n";
+                return System::Code::RESOURCE_EXHAUSTED;
+            }
+
+            // the FAT32 root directory is a cluster chain of its own
+            const auto root_clusters = traits_t::kRootDirIsChain ? dir_clusters(&fs._root, ctx._bytes_per_cluster) : 0;
+            plan._used_clusters = count_clusters(&fs._root, ctx._bytes_per_cluster) + root_clusters;
+            plan._end_cluster = allocation_end(&fs._root, ctx._bytes_per_cluster, 2 + root_clusters);
+            if ((plan._end_cluster - 2) > volume._data_clusters)
+            {
+                std::cerr << "*error: contents need " << (plan._end_cluster - 2) << " clusters but the volume only has " << volume._data_clusters << "\n";
+                return System::Code::RESOURCE_EXHAUSTED;
+            }
+
+            // only the part of the FAT that is in use, the rest of it is 0
+            constexpr auto kPacked = traits_t::kBits == 12;
+            const auto used_sectors = (traits_t::fat_bytes(plan._end_cluster) + (kSectorSizeBytes - 1)) / kSectorSizeBytes;
+            ctx._fat.resize(kPacked ? (used_sectors * kSectorSizeBytes * 2) / 3 : used_sectors * (kSectorSizeBytes / sizeof(entry_t)));
+
+            // fixed entries 0 and 1
+            ctx._fat[0] = entry_t((traits_t::kMask & ~entry_t(0xff)) | kMediaDescriptor);
+            ctx._fat[1] = traits_t::kEOC;
+            ctx._next_free_cluster = 2;
+
+            if (root_clusters)
+            {
+                // FAT32; the root directory starts at _root_cluster (i.e. 2).
+                //NOTE: fs._root keeps start cluster 0, which is what ".." entries refer to the root directory as
+                ctx.allocate_chain(root_clusters);
+            }
+
+            // recurse the directories and files
+            ctx.allocate_dir(&fs._root);
+            assert(ctx._next_free_cluster == plan._end_cluster);
+
+            plan._fat.resize(used_sectors * kSectorSizeBytes);
+            if constexpr (kPacked)
+            {
+                pack_fat12(ctx._fat.data(), ctx._fat.size(), reinterpret_cast<uint8_t*>(plan._fat.data()));
+            }
+            else
+            {
+                memcpy(plan._fat.data(), ctx._fat.data(), plan._fat.size());
+            }
+            return true;
+        }
+
+        // reads the contents of a file in sequence, either from memory or streamed from its source
+        struct file_reader_t
+        {
+            explicit file_reader_t(const fs_t::file_t* file)
+                : _file{ file }
+                , _bytes{ static_cast<const char*>(file->_data) }
+            {
+            }
+
+            // reading starts offset bytes into the file
+            bool open(size_t offset = 0)
+            {
+                _position = offset;
+                if (_bytes)
+                {
+                    _bytes += offset;
+                }
+                else if (!_file->_source_path)
+                {
+                    std::cerr << "*error: " << _file->_path << " has no contents to read\n";
+                    return false;
+                }
+                else
+                {
+                    // a buffer of our own, or opening the stream allocates one for every file
+                    _ifs.rdbuf()->pubsetbuf(_stream_buffer, sizeof _stream_buffer);
+                    _ifs.open(_file->_source_path, std::ios::binary);
+                    _ifs.seekg(std::streamoff(_file->_source_offset + offset));
+                    if (!_ifs.is_open() || !_ifs.good())
+                    {
+                        std::cerr << "*error: couldn't open " << _file->_source_path << "\n";
+                        return false;
+                    }
+                }
+                return true;
+            }
+
+            // read the next bytes of the file into buffer. Holes in sparse files are not read, so buffer has to be zeroed,
+            // and hole is set if all of it was a hole
+            bool read(char* buffer, size_t bytes, bool& hole)
+            {
+                hole = false;
+                if (_bytes)
+                {
+                    memcpy(buffer, _bytes, bytes);
+                    _bytes += bytes;
+                }
+                else if (_file->_extents)
+                {
+                    hole = true;
+                    const auto end = _position + bytes;
+                    for (; _next_extent < _file->_extent_count; ++_next_extent)
+                    {
+                        const auto& extent = _file->_extents[_next_extent];
+                        if (extent._offset >= end)
+                        {
+                            break;
+                        }
+                        const auto from = std::max(extent._offset, _position);
+                        const auto to = std::min(extent._offset + extent._size, end);
+                        if (from < to)
+                        {
+                            hole = false;
+                            _ifs.seekg(std::streamoff(_file->_source_offset + from));
+                            if (!_ifs.read(buffer + (from - _position), std::streamsize(to - from)))
+                            {
+                                std::cerr << "*error: couldn't read " << _file->_source_path << "\n";
+                                return false;
+                            }
+                        }
+                        if (extent._offset + extent._size > end)
+                        {
+                            // continues into the next read
+                            break;
+                        }
+                    }
+                }
+                else if (!_ifs.read(buffer, std::streamsize(bytes)))
+                {
+                    std::cerr << "*error: couldn't read " << _file->_source_path << "\n";
+                    return false;
+                }
+                _position += bytes;
+                return true;
+            }
+
+            const fs_t::file_t*     _file;
+            const char*             _bytes;
+            std::ifstream           _ifs;
+            char                    _stream_buffer[0x2000];
+            size_t                  _position = 0;
+            size_t                  _next_extent = 0;
+        };
+
+        // file contents are copied to the image in chunks of (up to) this many sectors
+        static constexpr size_t kFileChunkSectors = 128;
+        // runs of zeros are skipped in units of this many sectors, i.e. the block size of most file systems
+        static constexpr size_t kZeroRunSectors = 8;
+
+        // reads the contents of files on a separate thread ahead of them being written, so that reading and writing overlap.
+        // the files have to be written in the order given, chunk by chunk, and at most kChunks chunks are read ahead
+        struct content_pipeline_t
+        {
+            static constexpr size_t kChunks = 16;
+
+            struct chunk_t
+            {
+                std::unique_ptr<char[]> _data;
+                const fs_t::file_t*     _file = nullptr;
+                size_t                  _bytes = 0;
+                // all of it is a hole in a sparse file
+                bool                    _hole = false;
+                // false if the file couldn't be read, and no more chunks follow
+                bool                    _ok = true;
+            };
+
+            explicit content_pipeline_t(const std::vector<fs_t::file_t*>& files)
+                : _files{ files }
+            {
+                for (auto& chunk : _chunks)
+                {
+                    chunk._data.reset(new char[kFileChunkSectors * kSectorSizeBytes]);
+                }
+                _thread = std::thread{ [this]() { read_files(); } };
+            }
+            content_pipeline_t(const content_pipeline_t&) = delete;
+            content_pipeline_t& operator=(const content_pipeline_t&) = delete;
+            ~content_pipeline_t()
+            {
+                {
+                    std::lock_guard lock{ _mutex };
+                    _cancelled = true;
+                }
+                _condition.notify_all();
+                _thread.join();
+            }
+
+            // wait for the next chunk to be read, it stays valid until release
+            const chunk_t& acquire()
+            {
+                std::unique_lock lock{ _mutex };
+                _condition.wait(lock, [this]() { return _filled > 0; });
+                return _chunks[_next_read];
+            }
+
+            // the chunk from acquire has been written and can be reused
+            void release()
+            {
+                {
+                    std::lock_guard lock{ _mutex };
+                    _next_read = (_next_read + 1) % kChunks;
+                    --_filled;
+                }
+                _condition.notify_all();
+            }
+
+            // wait for a chunk to read into, nullptr if we have been cancelled
+            chunk_t* free_chunk()
+            {
+                std::unique_lock lock{ _mutex };
+                _condition.wait(lock, [this]() { return _cancelled || _filled < kChunks; });
+                //NOTE: only this thread touches the free chunks
+                return _cancelled ? nullptr : &_chunks[(_next_read + _filled) % kChunks];
+            }
+
+            void publish()
+            {
+                {
+                    std::lock_guard lock{ _mutex };
+                    ++_filled;
+                }
+                _condition.notify_all();
+            }
+
+            void read_files()
+            {
+                for (const auto* file : _files)
+                {
+                    file_reader_t reader{ file };
+                    auto ok = reader.open();
+                    auto bytes_left = file->_size;
+                    do
+                    {
+                        auto* chunk = free_chunk();
+                        if (!chunk)
+                        {
+                            return;
+                        }
+                        chunk->_file = file;
+                        chunk->_ok = ok;
+                        chunk->_bytes = std::min(bytes_left, kFileChunkSectors * kSectorSizeBytes);
+                        if (ok)
+                        {
+                            // the last sector is zero padded, and holes are zero
+                            const auto padded_bytes = ((chunk->_bytes + (kSectorSizeBytes - 1)) / kSectorSizeBytes) * kSectorSizeBytes;
+                            const auto clear_from = file->_extents ? 0 : chunk->_bytes;
+                            memset(chunk->_data.get() + clear_from, 0, padded_bytes - clear_from);
+                            chunk->_ok = ok = reader.read(chunk->_data.get(), chunk->_bytes, chunk->_hole);
+                            bytes_left -= chunk->_bytes;
+                        }
+                        publish();
+                    } while (bytes_left && ok);
+
+                    if (!ok)
+                    {
+                        // write_file gives up on the failed chunk
+                        return;
+                    }
+                }
+            }
+
+            const std::vector<fs_t::file_t*>&   _files;
+            chunk_t                             _chunks[kChunks];
+            std::mutex                          _mutex;
+            std::condition_variable             _condition;
+            // the chunks from _next_read (wrapping around) hold data that has been read but not yet written
+            size_t                              _next_read = 0;
+            size_t                              _filled = 0;
+            bool                                _cancelled = false;
+            std::thread                         _thread;
+        };
+
+        // the non empty files below dir, in the order they are laid out
+        void collect_files(const fs_t::dir_t* dir, std::vector<fs_t::file_t*>& files)
+        {
+            for_each_in_layout_order(dir, [&files](const auto&, const fs_t::dir_entry_t& entry) {
+                if (!entry._is_dir && entry._content._file->_size)
+                {
+                    files.push_back(entry._content._file);
+                }
+            });
+        }
+
+        // call write_run(first, sectors) for each run of the count sectors of data that isn't all zeros, zeros are looked for 
+        // in runs of kZeroRunSectors. Stops at the first write_run that fails
+        template<typename WriteRun>
+        bool for_each_data_run(const char* data, size_t count, WriteRun write_run)
+        {
+            // first sector not yet written or skipped
+            size_t first = 0;
+            for (size_t sector = 0; sector < count; sector += kZeroRunSectors)
+            {
+                const auto run = std::min(kZeroRunSectors, count - sector);
+                if (simd::is_zero(data + (sector * kSectorSizeBytes), run * kSectorSizeBytes))
+                {
+                    if (sector > first && !write_run(first, sector - first))
+                    {
+                        return false;
+                    }
+                    first = sector + run;
+                }
+            }
+            return first == count || write_run(first, count - first);
+        }
+
+        // write count sectors of data to a fresh image, leaving out runs of zeros since they read as zero anyway
+        bool write_sectors_skipping_zeros(disk_sector_writer_t* writer, const char* data, size_t count)
+        {
+            // sectors up to here have been written or skipped
+            size_t done = 0;
+            const auto written = for_each_data_run(data, count, [=, &done](size_t first, size_t sectors) {
+                writer->skip_sectors(first - done);
+                done = first + sectors;
+                return writer->write_sectors_from(data + (first * kSectorSizeBytes), sectors);
+            });
+            return written && writer->skip_sectors(count - done);
+        }
+
+        // stable sort of items by the source location of file_of(item), so that their contents are read in the order they are stored on disk
+        template<typename T, typename FileOf>
+        void sort_by_source_location(std::vector<T>& items, FileOf file_of)
+        {
+            std::vector<std::tuple<uint64_t, size_t, T>> located;
+            located.reserve(items.size());
+            for (auto& item : items)
+            {
+                const auto* file = file_of(item);
+                located.emplace_back(fs_t::source_location(file), file->_source_offset, std::move(item));
+            }
+            std::stable_sort(located.begin(), located.end(), [](const auto& a, const auto& b) {
+                return std::tie(std::get<0>(a), std::get<1>(a)) < std::tie(std::get<0>(b), std::get<1>(b));
+            });
+            for (size_t n = 0; n < items.size(); ++n)
+            {
+                items[n] = std::move(std::get<2>(located[n]));
+            }
+        }
+
+        bool write_file(disk_sector_writer_t* writer, const volume_t& volume, fs_t::file_t* file, content_pipeline_t* pipeline)
+        {
+            if (!file->_size)
+            {
+                file->_hash = utils::kFnv1a64Basis;
+                return true;
+            }
+
+            // the contents of a file are laid out in a linear chain starting at 
+            // the start cluster, here we just copy it in chunk by chunk as the pipeline reads it
+            auto file_sector = volume.cluster_to_lba(file->_start_cluster);
+            auto bytes_left = file->_size;
+            auto hash = utils::kFnv1a64Basis;
+
+            writer->seek_from_beg(file_sector);
+
+            if (_verbose)
+            {
+                std::cout << "\tfile of " << bytes_left << " bytes starts at cluster " << file->_start_cluster << ", sectors [" << file_sector;
+            }
+
+            while (bytes_left)
+            {
+                const auto& chunk = pipeline->acquire();
+                assert(chunk._file == file);
+                if (!chunk._ok)
+                {
+                    return false;
+                }
+
+                const auto chunk_sectors = (chunk._bytes + (kSectorSizeBytes - 1)) / kSectorSizeBytes;
+                if (_update)
+                {
+                    hash = utils::fnv1a_64(hash, chunk._data.get(), chunk._bytes);
+                }
+
+                auto written = true;
+                if (chunk._hole && writer->image().fresh())
+                {
+                    writer->skip_sectors(chunk_sectors);
+                }
+                else if (writer->image().fresh())
+                {
+                    written = write_sectors_skipping_zeros(writer, chunk._data.get(), chunk_sectors);
+                }
+                else
+                {
+                    written = writer->write_sectors_from(chunk._data.get(), chunk_sectors);
+                }
+                file_sector += chunk_sectors;
+                bytes_left -= chunk._bytes;
+                pipeline->release();
+
+                if (!written)
+                {
+                    return false;
+                }
+            }
+            file->_hash = hash;
+
+            if (_verbose)
+            {
+                const auto sectors_used = (file_sector - volume.cluster_to_lba(file->_start_cluster));
+                const auto clusters_used = (sectors_used + (volume._sectors_per_cluster - 1)) / volume._sectors_per_cluster;
+                std::cout << ", " << file_sector << ">, " << clusters_used << " clusters" << std::endl;
+            }
+            return true;
+        }
+
+        // hash of the contents of file, as calculated by write_file
+        System::status_or_t<uint64_t> hash_file(const fs_t::file_t* file)
+        {
+            if (!file->_size)
+            {
+                // as write_file, there is nothing to read (and empty files from archives read from stdin have nowhere to read it from)
+                return utils::kFnv1a64Basis;
+            }
+            file_reader_t reader{ file };
+            if (!reader.open())
+            {
+                return System::Code::UNAVAILABLE;
+            }
+
+            auto hash = utils::kFnv1a64Basis;
+            std::unique_ptr<char[]> buffer{ new char[kFileChunkSectors * kSectorSizeBytes] };
+            for (auto bytes_left = file->_size; bytes_left;)
+            {
+                const auto chunk_bytes = std::min(bytes_left, kFileChunkSectors * kSectorSizeBytes);
+                auto hole = false;
+                if (file->_extents)
+                {
+                    memset(buffer.get(), 0, chunk_bytes);
+                }
+                if (!reader.read(buffer.get(), chunk_bytes, hole))
+                {
+                    return System::Code::UNAVAILABLE;
+                }
+                hash = utils::fnv1a_64(hash, buffer.get(), chunk_bytes);
+                bytes_left -= chunk_bytes;
+            }
+            return hash;
+        }
+
+        // fill in the entries of a directory. The root directory (for either FAT16 or FAT32) is special and has no '.' or '..' entries, 
+        // instead the first entry is always the volume label entry (which must match the volume label set in the BPB)
+        // the long name entries for a name of length characters, in the order they are stored. returns the entry after them
+        fat_dir_entry_t* add_long_name(fat_dir_entry_t* dir_entry, const char16_t* name, size_t length, uint8_t checksum)
+        {
+            const auto count = (length + (kLfnCharsPerEntry - 1)) / kLfnCharsPerEntry;
+            for (auto n = count; n > 0; --n)
+            {
+                auto* lfn = reinterpret_cast<fat_lfn_entry_t*>(dir_entry++);
+                lfn->_order = uint8_t(n | (n == count ? kLfnLastEntry : 0));
+                lfn->_attrib = uint8_t(fat_file_attribute::kLongName);
+                lfn->_type = 0;
+                lfn->_checksum = checksum;
+                lfn->_first_cluster_lo = 0;
+
+                uint16_t chars[kLfnCharsPerEntry];
+                for (size_t c = 0; c < kLfnCharsPerEntry; ++c)
+                {
+                    const auto i = ((n - 1) * kLfnCharsPerEntry) + c;
+                    chars[c] = i < length ? uint16_t(name[i]) : (i == length ? 0 : 0xffff);
+                }
+                memcpy(lfn->_name1, chars, sizeof lfn->_name1);
+                memcpy(lfn->_name2, chars + 5, sizeof lfn->_name2);
+                memcpy(lfn->_name3, chars + 11, sizeof lfn->_name3);
+            }
+            return dir_entry;
+        }
+
+        void fill_dir_entries(fat_dir_entry_t* dir_entry, const fs_t::dir_t* dir, const char* volumeLabel, short_names_t& short_names)
+        {
+            const auto* indent = volumeLabel ? "\t" : "\t\t";
+            if (volumeLabel)
+            {
+                dir_entry->set_label(volumeLabel);
+                dir_entry->_attrib = uint8_t(fat_file_attribute::kVolumeId);
+                ++dir_entry;
+
+                if (_verbose)
+                {
+                    std::cout << "\tvolume label \"" << volumeLabel << "\"\n";
+                }
+            }
+            else
+            {
+                // add standard "." and ".." entries
+                dir_entry->set_name(".");
+                dir_entry->_attrib = uint8_t(fat_file_attribute::kDirectory);
+                dir_entry->set_first_cluster(dir->_start_cluster);
+                dir_entry++;
+                dir_entry->set_name("..");
+                dir_entry->_attrib = uint8_t(fat_file_attribute::kDirectory);
+                dir_entry->set_first_cluster(dir->_parent->_start_cluster);
+                dir_entry++;
+            }
+
+            //NOTE: dir_entry has room for dir_entry_count(dir) entries
+            short_names.reset(dir);
+            char16_t long_name[kLfnMaxChars];
+            // hot entries first, so that the firmware finds them in the first sectors it reads
+            for_each_entry(dir, [&](const auto& name, const fs_t::dir_entry_t& entry) {
+                if (is_short_name(name))
+                {
+                    dir_entry->set_name(name.c_str());
+                }
+                else
+                {
+                    fat_dir_entry_t short_entry;
+                    short_names.alias(name, short_entry._short_name);
+                    dir_entry = add_long_name(dir_entry, long_name, utils::utf8_to_utf16(name, long_name, kLfnMaxChars), short_entry.lfn_checksum());
+                    memcpy(dir_entry->_short_name, short_entry._short_name, sizeof short_entry._short_name);
+                }
+                if (entry._is_dir)
+                {
+                    dir_entry->_attrib = uint8_t(fat_file_attribute::kDirectory);
+                    dir_entry->set_first_cluster(entry._content._dir->_start_cluster);
+
+                    if (_verbose)
+                    {
+                        std::cout << indent << "added directory \"" << name << "\", starting at cluster " << dir_entry->first_cluster() << "\n";
+                    }
+                }
+                else
+                {
+                    dir_entry->_size = entry._content._file->_size;
+                    dir_entry->set_first_cluster(entry._content._file->_start_cluster);
+
+                    if (_verbose)
+                    {
+                        std::cout << indent << "added file \"" << name << "\", " << dir_entry->_size << " bytes, starting at cluster " << dir_entry->first_cluster() << "\n";
+                    }
+                }
+                ++dir_entry;
+            });
+        }
+
+        // what writing the entries of a directory takes, kept from one directory to the next so that nothing is allocated for each of them
+        struct dir_buffers_t
+        {
+            std::vector<fat_dir_entry_t>    _entries;
+            short_names_t                   _short_names;
+        };
+
+        // write the entries of dir to where it has been allocated, in one write. 
+        // only the sectors up to and including the first free entry are written, nothing after it is ever read
+        template<typename traits_t>
+        bool write_dir_entries(disk_sector_writer_t* writer, const volume_t& volume, const fs_t::dir_t* dir, dir_buffers_t& buffers)
+        {
+            const auto is_root = !dir->_parent;
+            const auto bytes_per_cluster = volume._sectors_per_cluster * kSectorSizeBytes;
+            const auto capacity = is_root && !traits_t::kRootDirIsChain ? kFat16RootEntryCount : (dir_clusters(dir, bytes_per_cluster) * bytes_per_cluster) / sizeof(fat_dir_entry_t);
+            const auto sectors = ((std::min(dir_entry_count(dir) + 1, capacity) * sizeof(fat_dir_entry_t)) + (kSectorSizeBytes - 1)) / kSectorSizeBytes;
+
+            auto& entries = buffers._entries;
+            entries.assign(sectors * (kSectorSizeBytes / sizeof(fat_dir_entry_t)), fat_dir_entry_t{});
+            fill_dir_entries(entries.data(), dir, is_root ? volume._label.c_str() : nullptr, buffers._short_names);
+            writer->seek_from_beg(is_root ? volume._root_dir_lba : volume.cluster_to_lba(dir->_start_cluster));
+            return writer->write_sectors_from(reinterpret_cast<const char*>(entries.data()), sectors);
+        }
+
+#ifndef _WIN32
+        namespace
+        {
+            // write all bytes of data at offset, pwrite can write less than it is asked to
+            bool pwrite_all(int fd, const char* data, size_t bytes, size_t offset)
+            {
+                while (bytes)
+                {
+                    const auto written = ::pwrite(fd, data, bytes, off_t(offset));
+                    if (written < 0 && errno == EINTR)
+                    {
+                        continue;
+                    }
+                    if (written <= 0)
+                    {
+                        return false;
+                    }
+                    data += written;
+                    bytes -= size_t(written);
+                    offset += size_t(written);
+                }
+                return true;
+            }
+        }
+
+        // write the contents of files from _jobs threads at once. Every file has clusters of its own, so each thread writes 
+        // straight to the sectors planned for what it is writing and no two threads ever write the same sectors. 
+        // large files are split in pieces written by different threads, unless they are hashed as a whole for -u
+        bool write_files_parallel(disk_sector_writer_t* writer, const plan_t& plan, const std::vector<fs_t::file_t*>& files)
+        {
+            // what one thread writes in one go
+            struct piece_t
+            {
+                fs_t::file_t*   _file;
+                size_t          _offset;
+                size_t          _bytes;
+            };
+            // a whole number of chunks
+            static constexpr size_t kPieceBytes = 64 * kFileChunkSectors * kSectorSizeBytes;
+
+            std::vector<piece_t> pieces;
+            pieces.reserve(files.size());
+            for (auto* file : files)
+            {
+                const auto piece_bytes = _update ? file->_size : kPieceBytes;
+                for (size_t offset = 0; offset < file->_size; offset += piece_bytes)
+                {
+                    pieces.push_back({ file, offset, std::min(piece_bytes, file->_size - offset) });
+                }
+            }
+
+            // what has been written through writer has to be in the image before anything is written to it behind its back
+            auto& image = writer->image();
+            image._fs.flush();
+            const auto fd = ::open(image._path.c_str(), O_WRONLY | O_CLOEXEC);
+            if (fd < 0)
+            {
+                std::cerr << "*error: couldn't open " << image._path << " for writing\n";
+                return false;
+            }
+
+            const auto fresh = image.fresh();
+            std::atomic<size_t> next_piece{ 0 };
+            std::atomic<size_t> skipped_sectors{ 0 };
+            std::atomic<bool> failed{ false };
+            const auto write_pieces = [&]()
+            {
+                std::unique_ptr<char[]> buffer{ new char[kFileChunkSectors * kSectorSizeBytes] };
+                size_t skipped = 0;
+                for (auto n = next_piece++; n < pieces.size() && !failed; n = next_piece++)
+                {
+                    const auto& piece = pieces[n];
+                    auto* file = piece._file;
+                    file_reader_t reader{ file };
+                    auto ok = reader.open(piece._offset);
+                    auto lba = plan._partition_lba + plan._volume.cluster_to_lba(file->_start_cluster) + (piece._offset / kSectorSizeBytes);
+                    auto hash = utils::kFnv1a64Basis;
+                    for (auto bytes_left = piece._bytes; ok && bytes_left; )
+                    {
+                        const auto bytes = std::min(bytes_left, kFileChunkSectors * kSectorSizeBytes);
+                        const auto sectors = (bytes + (kSectorSizeBytes - 1)) / kSectorSizeBytes;
+                        // the last sector is zero padded, and holes are zero
+                        const auto clear_from = file->_extents ? 0 : bytes;
+                        memset(buffer.get() + clear_from, 0, (sectors * kSectorSizeBytes) - clear_from);
+                        auto hole = false;
+                        ok = reader.read(buffer.get(), bytes, hole);
+                        if (ok && _update)
+                        {
+                            hash = utils::fnv1a_64(hash, buffer.get(), bytes);
+                        }
+
+                        const auto write_run = [&](size_t first, size_t count) {
+                            return pwrite_all(fd, buffer.get() + (first * kSectorSizeBytes), count * kSectorSizeBytes, (lba + first) * kSectorSizeBytes);
+                        };
+                        if (ok && fresh)
+                        {
+                            // a new image reads as zeros, so neither holes nor runs of zeros are written to it
+                            size_t written = 0;
+                            ok = hole || for_each_data_run(buffer.get(), sectors, [&](size_t first, size_t count) {
+                                written += count;
+                                return write_run(first, count);
+                            });
+                            skipped += sectors - written;
+                        }
+                        else if (ok)
+                        {
+                            ok = write_run(0, sectors);
+                        }
+                        lba += sectors;
+                        bytes_left -= bytes;
+                    }
+
+                    if (!ok)
+                    {
+                        failed = true;
+                    }
+                    else if (_update)
+                    {
+                        file->_hash = hash;
+                    }
+                }
+                skipped_sectors += skipped;
+            };
+
+            std::vector<std::thread> threads;
+            for (size_t n = 1; n < std::min(_jobs, pieces.size()); ++n)
+            {
+                threads.emplace_back(write_pieces);
+            }
+            write_pieces();
+            for (auto& thread : threads)
+            {
+                thread.join();
+            }
+
+            if (::close(fd) != 0 || failed)
+            {
+                if (!failed)
+                {
+                    std::cerr << "*error: couldn't write " << image._path << "\n";
+                }
+                return false;
+            }
+            writer->_skipped_sectors += skipped_sectors;
+
+            if (_verbose)
+            {
+                std::cout << "\t" << files.size() << " files written in " << pieces.size() << " pieces by " << (threads.size() + 1) << " threads\n";
+            }
+            return true;
+        }
+#endif
+
+        // write the directories and files of plan, writer is at the start of the partition
+        template<typename traits_t>
+        System::status_or_t<bool> write_contents(disk_sector_writer_t* writer, const plan_t& plan)
+        {
+            const auto& volume = plan._volume;
+
+            std::vector<fs_t::file_t*> files;
+            files.reserve(size_t(std::count_if(plan._extents.begin(), plan._extents.end(), [](const extent_t& extent) { return extent._kind == extent_t::kind_t::kFile; })));
+            dir_buffers_t dir_buffers;
+            for (const auto& extent : plan._extents)
+            {
+                if (extent._kind == extent_t::kind_t::kRootDir || extent._kind == extent_t::kind_t::kDir)
+                {
+                    if (!write_dir_entries<traits_t>(writer, volume, extent._dir, dir_buffers))
+                    {
+                        return System::Code::UNAVAILABLE;
+                    }
+                }
+                else if (extent._kind == extent_t::kind_t::kFile)
+                {
+                    files.push_back(extent._file);
+                }
+            }
+
+            // every file has its place in the image already, so they can be written in any order.
+            // contents are read ahead in that order while they are being written
+            if (_physical_order)
+            {
+                sort_by_source_location(files, [](const fs_t::file_t* file) { return file; });
+            }
+#ifndef _WIN32
+            if (_jobs > 1)
+            {
+                if (!write_files_parallel(writer, plan, files))
+                {
+                    return System::Code::UNAVAILABLE;
+                }
+                return true;
+            }
+#endif
+            content_pipeline_t pipeline{ files };
+            for (auto* file : files)
+            {
+                if (!write_file(writer, volume, file, &pipeline))
+                {
+                    return System::Code::UNAVAILABLE;
+                }
+            }
+
+            return true;
+        }
+
+        namespace
+        {
+            // the layout of a volume once the type of FAT and the cluster size have been decided
+            volume_t layout_volume(size_t total_sectors, unsigned fat_bits, size_t sectors_per_cluster)
+            {
+                volume_t volume;
+                volume._num_fats = 2;   // industry standard
+                volume._fat_bits = fat_bits;
+                volume._sectors_per_cluster = sectors_per_cluster;
+
+                size_t root_dir_sector_count = 0;
+                if (fat_bits == 32)
+                {
+                    volume._reserved_sectors = kReservedSectorCount;  // as per standard for FAT32, this is 16K
+                }
+                else
+                {
+                    volume._reserved_sectors = 1;
+                    root_dir_sector_count = ((kFat16RootEntryCount * 32) + (kSectorSizeBytes - 1)) / kSectorSizeBytes;
+                }
+                if (total_sectors <= volume._reserved_sectors + root_dir_sector_count)
+                {
+                    return volume;
+                }
+
+                const auto tmp1 = static_cast<unsigned long long>(total_sectors - (volume._reserved_sectors + root_dir_sector_count));
+                if (fat_bits == 12)
+                {
+                    // MS' calculation below is only for FAT16 and FAT32. 12 bit entries are packed 2 to 3 bytes, and this is enough
+                    // for every cluster that fits in the sectors left if the FATs took no space at all
+                    const auto max_clusters = size_t(tmp1 / sectors_per_cluster);
+                    volume._sectors_per_fat = ((((2 + max_clusters) * 3) + 1) / 2 + (kSectorSizeBytes - 1)) / kSectorSizeBytes;
+                }
+                else
+                {
+                    // this magic piece of calculation is taken from from MS' white paper where it states;
+                    // "Do not spend too much time trying to figure out why this math works."
+                    auto tmp2 = (256 * sectors_per_cluster) + volume._num_fats;
+                    if (fat_bits == 32)
+                    {
+                        tmp2 /= 2;
+                    }
+                    volume._sectors_per_fat = size_t((tmp1 + (tmp2 - 1)) / tmp2);
+                }
+
+                // for FAT12 and FAT16 the root directory is stored before the data area in a fixed size area, for FAT32 it is the first data cluster
+                volume._root_dir_lba = volume._reserved_sectors + (volume._num_fats * volume._sectors_per_fat);
+                volume._first_data_lba = volume._root_dir_lba + root_dir_sector_count;
+                if (_align_bytes > kSectorSizeBytes)
+                {
+                    // more reserved sectors move the data area to the next boundary. The partition starts on one as well, see gpt::partition_start_lba
+                    const auto align_sectors = _align_bytes / kSectorSizeBytes;
+                    const auto padding = (align_sectors - (volume._first_data_lba % align_sectors)) % align_sectors;
+                    volume._reserved_sectors += padding;
+                    volume._root_dir_lba += padding;
+                    volume._first_data_lba += padding;
+                }
+                volume._data_clusters = total_sectors > volume._first_data_lba ? (total_sectors - volume._first_data_lba) / sectors_per_cluster : 0;
+                return volume;
+            }
+
+            // the type of FAT is determined by the number of data clusters alone, see MS fat documentation
+            bool is_legal(const volume_t& volume)
+            {
+                switch (volume._fat_bits)
+                {
+                case 12:
+                    return volume._data_clusters && volume._data_clusters <= kFat12MaxClusters;
+                case 16:
+                    return volume._data_clusters > kFat12MaxClusters && volume._data_clusters <= kFat16MaxClusters;
+                case 32:
+                    return volume._data_clusters > kFat16MaxClusters && volume._data_clusters <= kFat32MaxClusters;
+                default:;
+                }
+                return false;
+            }
+
+            // bytes of file contents and directory entries in dir and below, not counting the entries of dir itself
+            size_t content_bytes(const fs_t::dir_t* dir)
+            {
+                size_t bytes = 0;
+                for (const auto& [name, entry] : dir->_entries)
+                {
+                    if (entry._is_dir)
+                    {
+                        bytes += (dir_entry_count(entry._content._dir) * sizeof(fat_dir_entry_t)) + content_bytes(entry._content._dir);
+                    }
+                    else
+                    {
+                        bytes += entry._content._file->_size;
+                    }
+                }
+                return bytes;
+            }
+
+            // sectors of the image outside the partition; the GPT before it and 3 sectors at the end, see gpt::create_efi_boot_image
+            size_t gpt_sectors()
+            {
+                return gpt::partition_start_lba() + 3;
+            }
+            // images are rounded to 64K, the same as disk_sector_image_t::open rounds to
+            constexpr size_t kSmallStep = 0x10000;
+
+            // the smallest image to start looking from for contents of bytes; at least 64K more than what is outside the partition
+            size_t smallest_image_size(size_t bytes)
+            {
+                const auto least = (gpt_sectors() * kSectorSizeBytes) + kSmallStep;
+                return (std::max(bytes, least) + (kSmallStep - 1)) & ~(kSmallStep - 1);
+            }
+
+            // clusters spanned by the contents of fs, including any skipped to align files
+            size_t spanned_clusters(const fs_t& fs, size_t bytes_per_cluster, unsigned fat_bits)
+            {
+                // the FAT32 root directory is a cluster chain of its own
+                const auto root_clusters = fat_bits == 32 ? dir_clusters(&fs._root, bytes_per_cluster) : 0;
+                return allocation_end(&fs._root, bytes_per_cluster, 2 + root_clusters) - 2;
+            }
+
+            // the smallest image that fs fits in with clusters of sectors_per_cluster, and a legal layout for it
+            size_t image_size_for(const fs_t& fs, size_t sectors_per_cluster)
+            {
+                const auto bytes_per_cluster = sectors_per_cluster * kSectorSizeBytes;
+                // the FAT32 root directory takes clusters, the FAT12 and FAT16 one has a fixed number of entries
+                const auto clusters = spanned_clusters(fs, bytes_per_cluster, 16);
+                const auto fat32_clusters = spanned_clusters(fs, bytes_per_cluster, 32);
+                const auto root_entries = dir_entry_count(&fs._root);
+
+                // the contents need at least this much, the loop adds the FATs and the rest of the overhead
+                auto size = smallest_image_size(clusters * bytes_per_cluster);
+                for (;; size += kSmallStep)
+                {
+                    const auto volume = volume_layout((size / kSectorSizeBytes) - gpt_sectors(), sectors_per_cluster);
+                    if (!volume._fat_bits || (volume._fat_bits != 32 && root_entries > kFat16RootEntryCount))
+                    {
+                        continue;
+                    }
+                    if ((volume._fat_bits == 32 ? fat32_clusters : clusters) <= volume._data_clusters)
+                    {
+                        return size;
+                    }
+                }
+            }
+        }
+
+        volume_t volume_layout(size_t total_sectors, size_t sectors_per_cluster)
+        {
+            if (sectors_per_cluster)
+            {
+                // the smallest FAT that makes a legal volume with this many clusters, if any does
+                for (const auto fat_bits : { 12u, 16u, 32u })
+                {
+                    const auto volume = layout_volume(total_sectors, fat_bits, sectors_per_cluster);
+                    if (is_legal(volume))
+                    {
+                        return volume;
+                    }
+                }
+                return {};
+            }
+
+            // as per MS Windows' standard; any volume of size < 512MB shall be FAT16, unless it is small enough for FAT12
+            const auto size = static_cast<unsigned long long>(total_sectors * kSectorSizeBytes);
+            unsigned fat_bits = 32;
+            if (total_sectors <= std::end(kDiskTableFat12)[-1]._sector_limit)
+            {
+                fat_bits = 12;
+            }
+            else if (size < 0x20000000)
+            {
+                fat_bits = 16;
+            }
+
+            // from MS' white paper on FAT
+            const auto table_sectors_per_cluster = [total_sectors](const auto& table) -> size_t {
+                for (const auto& entry : table)
+                {
+                    if (total_sectors <= entry._sector_limit)
+                    {
+                        return entry._sectors_per_cluster;
+                    }
+                }
+                return 0;
+            };
+            if (fat_bits == 12)
+            {
+                sectors_per_cluster = table_sectors_per_cluster(kDiskTableFat12);
+            }
+            else if (fat_bits == 16)
+            {
+                sectors_per_cluster = table_sectors_per_cluster(kDiskTableFat16);
+            }
+            else
+            {
+                sectors_per_cluster = table_sectors_per_cluster(kDiskTableFat32);
+            }
+            return layout_volume(total_sectors, fat_bits, sectors_per_cluster);
+        }
+
+        size_t image_size_for(const fs_t& fs)
+        {
+            if (_sectors_per_cluster)
+            {
+                return image_size_for(fs, _sectors_per_cluster);
+            }
+
+            // images are sized in steps of 128 Megs, except for contents small enough for a FAT12 volume. These get a compact
+            // image in steps of 64K
+            constexpr size_t kStep = 0x8000000;
+            const size_t kLargestFat12Image = (std::end(kDiskTableFat12)[-1]._sector_limit + gpt_sectors()) * kSectorSizeBytes;
+
+            auto size = smallest_image_size(fs.size());
+            for (;;)
+            {
+                if (size > kLargestFat12Image)
+                {
+                    size = (size + (kStep - 1)) & ~(kStep - 1);
+                }
+                const auto volume = volume_layout((size / kSectorSizeBytes) - gpt_sectors());
+                if (spanned_clusters(fs, volume._sectors_per_cluster * kSectorSizeBytes, volume._fat_bits) <= volume._data_clusters)
+                {
+                    return size;
+                }
+                size += size < kStep ? kSmallStep : kStep;
+            }
+        }
+
+        size_t optimal_sectors_per_cluster(const fs_t& fs)
+        {
+            if (_verbose)
+            {
+                std::cout << "\tcluster size     FAT     clusters          slack    FAT overhead      image size\n";
+            }
+
+            size_t best = 0;
+            size_t best_size = 0;
+            const auto bytes = content_bytes(&fs._root);
+            for (size_t sectors_per_cluster = 1; sectors_per_cluster <= kMaxSectorsPerCluster; sectors_per_cluster *= 2)
+            {
+                const auto size = image_size_for(fs, sectors_per_cluster);
+                // ties go to the larger clusters, there are fewer of them to allocate and follow
+                if (!best || size <= best_size)
+                {
+                    best = sectors_per_cluster;
+                    best_size = size;
+                }
+
+                if (_verbose)
+                {
+                    const auto volume = volume_layout((size / kSectorSizeBytes) - gpt_sectors(), sectors_per_cluster);
+                    const auto bytes_per_cluster = sectors_per_cluster * kSectorSizeBytes;
+                    const auto root_bytes = volume._fat_bits == 32 ? dir_entry_count(&fs._root) * sizeof(fat_dir_entry_t) : 0;
+                    const auto clusters = spanned_clusters(fs, bytes_per_cluster, volume._fat_bits);
+                    std::cout << "\t" << std::setw(12) << bytes_per_cluster << std::setw(8) << volume._fat_bits << std::setw(13) << clusters
+                        << std::setw(15) << ((clusters * bytes_per_cluster) - bytes - root_bytes)
+                        << std::setw(16) << (volume._num_fats * volume._sectors_per_fat * kSectorSizeBytes)
+                        << std::setw(16) << size << "\n";
+                }
+            }
+
+            if (_verbose)
+            {
+                std::cout << "\tusing " << (best * kSectorSizeBytes) << " byte clusters\n";
+            }
+            return best;
+        }
+
+        namespace
+        {
+            // extents of the directories below dir, in the order fat_context_t::allocate_dir allocates them
+            void plan_dirs(plan_t& plan, const fs_t::dir_t* dir)
+            {
+                const auto& volume = plan._volume;
+                for_each_in_layout_order(dir, [&](const auto&, const fs_t::dir_entry_t& entry) {
+                    if (entry._is_dir)
+                    {
+                        extent_t extent{ extent_t::kind_t::kDir };
+                        extent._lba = plan._partition_lba + volume.cluster_to_lba(entry._content._dir->_start_cluster);
+                        extent._sectors = dir_clusters(entry._content._dir, volume._sectors_per_cluster * kSectorSizeBytes) * volume._sectors_per_cluster;
+                        extent._dir = entry._content._dir;
+                        plan._extents.push_back(extent);
+                    }
+                });
+            }
+        }
+
+        System::status_or_t<plan_t> plan_image(size_t image_sectors, const char* volumeLabel, fs_t& fs)
+        {
+            if (image_sectors <= gpt_sectors())
+                return System::Code::FAILED_PRECONDITION;
+
+            plan_t plan;
+            plan._image_sectors = image_sectors;
+            plan._partition_lba = gpt::partition_start_lba();
+            // up to the backup GPT, see gpt::create_efi_boot_image
+            plan._partition_sectors = image_sectors - gpt_sectors();
+
+            auto& volume = plan._volume;
+            volume = volume_layout(plan._partition_sectors, _sectors_per_cluster);
+            if (!volume._fat_bits)
+            {
+                std::cerr << "*error: a volume of " << plan._partition_sectors << " sectors can't have " << (_sectors_per_cluster * kSectorSizeBytes) << " byte clusters\n";
+                return System::Code::INVALID_ARGUMENT;
+            }
+            volume._label = volumeLabel;
+
+            const auto fat_result = with_fat_traits(volume._fat_bits, [&](auto traits) { return plan_fat<decltype(traits)>(plan, fs); });
+            if (!fat_result)
+            {
+                return fat_result.error_code();
+            }
+
+            using kind_t = extent_t::kind_t;
+            const auto add = [&plan](kind_t kind, size_t lba, size_t sectors) -> extent_t& {
+                plan._extents.push_back({ kind, lba, sectors });
+                return plan._extents.back();
+            };
+            const auto last_lba = image_sectors - 1;
+            const auto partition = plan._partition_lba;
+            const auto bytes_per_cluster = volume._sectors_per_cluster * kSectorSizeBytes;
+
+            add(kind_t::kProtectiveMbr, 0, 1);
+            add(kind_t::kGptHeader, 1, 1);
+            // the minimum size of the entry array, only the first entry is used
+            add(kind_t::kGptEntries, 2, gpt::kFirstUsableLba - 2);
+            add(kind_t::kBackupGptEntries, last_lba - 1, 1);
+            add(kind_t::kBackupGptHeader, last_lba, 1);
+
+            add(kind_t::kBootSector, partition, 1);
+            if (volume._fat_bits == 32)
+            {
+                add(kind_t::kFsInfo, partition + 1, 1);
+            }
+            for (size_t n = 0; n < volume._num_fats; ++n)
+            {
+                add(kind_t::kFat, partition + volume._reserved_sectors + (n * volume._sectors_per_fat), volume._sectors_per_fat)._copy = n;
+            }
+
+            // the FAT16 (and FAT12) root directory has an area of its own in front of the data area, the FAT32 one starts at cluster 2
+            if (volume._fat_bits != 32)
+            {
+                add(kind_t::kRootDir, partition + volume._root_dir_lba, (kFat16RootEntryCount * sizeof(fat_dir_entry_t)) / kSectorSizeBytes)._dir = &fs._root;
+            }
+            else
+            {
+                add(kind_t::kRootDir, partition + volume.cluster_to_lba(2), dir_clusters(&fs._root, bytes_per_cluster) * volume._sectors_per_cluster)._dir = &fs._root;
+            }
+            plan_dirs(plan, &fs._root);
+
+            std::vector<fs_t::file_t*> files;
+            collect_files(&fs._root, files);
+            for (auto* file : files)
+            {
+                const auto clusters = (file->_size + (bytes_per_cluster - 1)) / bytes_per_cluster;
+                add(kind_t::kFile, partition + volume.cluster_to_lba(file->_start_cluster), clusters * volume._sectors_per_cluster)._file = file;
+            }
+
+            return plan;
+        }
+
+        void print_plan(const plan_t& plan, std::ostream& os)
+        {
+            static constexpr const char* kKindNames[] = { "protective MBR", "GPT header", "GPT entries", "backup GPT entries", "backup GPT header", 
+                "boot sector", "FSInfo", "FAT", "root directory", "directory", "file" };
+
+            const auto& volume = plan._volume;
+            os << "\t" << plan._image_sectors << " sector image, FAT" << volume._fat_bits << " partition of " << plan._partition_sectors << " sectors at LBA " << plan._partition_lba 
+                << ", " << (volume._sectors_per_cluster * kSectorSizeBytes) << " byte clusters, " << plan._used_clusters << " of " << volume._data_clusters << " clusters used\n";
+            os << "\t       lba   sectors\n";
+            for (const auto& extent : plan._extents)
+            {
+                os << "\t" << std::setw(10) << extent._lba << std::setw(10) << extent._sectors << "  " << kKindNames[size_t(extent._kind)];
+                if (extent._kind == extent_t::kind_t::kFat)
+                {
+                    os << " " << extent._copy;
+                }
+                else if (extent._kind == extent_t::kind_t::kDir)
+                {
+                    os << " " << extent._dir->_path;
+                }
+                else if (extent._kind == extent_t::kind_t::kFile)
+                {
+                    os << " " << extent._file->_path;
+                }
+                os << "\n";
+            }
+
+            // the loaders are reported even when they aren't placed first, to compare against
+            const auto is_loader = [](const fs_t::file_t* file) {
+                return std::any_of(std::begin(kRemovableMediaLoaders), std::end(kRemovableMediaLoaders), [&](const char* loader) { return utils::equal_ignoring_case(file->_path, loader); });
+            };
+            for (const auto& extent : plan._extents)
+            {
+                if (extent._kind == extent_t::kind_t::kFile && (extent._file->_hot || is_loader(extent._file)))
+                {
+                    os << "\tfirmware lookup of " << extent._file->_path << " reads " << lookup_sectors(plan, extent._file) << " sectors\n";
+                }
+            }
+        }
+
+        template<typename traits_t>
+        size_t lookup_sectors(const plan_t& plan, const fs_t::file_t* file)
+        {
+            const auto& volume = plan._volume;
+            // of the partition, the boot sector is read first
+            std::vector<size_t> sectors{ 0 };
+            const auto fat_sectors_of = [&](size_t cluster) {
+                // FAT12 entries can straddle two sectors
+                const auto offset = traits_t::entry_offset(cluster);
+                sectors.push_back(volume._reserved_sectors + (offset / kSectorSizeBytes));
+                sectors.push_back(volume._reserved_sectors + ((offset + traits_t::kEntryBytes - 1) / kSectorSizeBytes));
+            };
+
+            // each directory on the path is searched from its start up to the entry of the next name on it
+            const auto slash = file->_path.rfind('/');
+            auto name = slash == std::string_view::npos ? file->_path : file->_path.substr(slash + 1);
+            for (const auto* dir = file->_parent; dir; name = dir->_name, dir = dir->_parent)
+            {
+                // the volume label in the root directory, "." and ".." in the others
+                size_t index = dir->_parent ? 2 : 1;
+                auto found = false;
+                for_each_entry(dir, [&](const auto& entry_name, const fs_t::dir_entry_t&) {
+                    if (found)
+                    {
+                        return;
+                    }
+                    // the short entry follows the long name entries
+                    index += lfn_entry_count(entry_name);
+                    found = entry_name == name;
+                    if (!found)
+                    {
+                        ++index;
+                    }
+                });
+                assert(found);
+                const auto last_sector = (index * sizeof(fat_dir_entry_t)) / kSectorSizeBytes;
+
+                if (!dir->_parent && !traits_t::kRootDirIsChain)
+                {
+                    // the fixed root directory area
+                    for (size_t n = 0; n <= last_sector; ++n)
+                    {
+                        sectors.push_back(volume._root_dir_lba + n);
+                    }
+                    continue;
+                }
+                // the FAT32 root directory starts at cluster 2
+                const auto first_cluster = dir->_parent ? dir->_start_cluster : 2;
+                for (size_t n = 0; n <= last_sector; ++n)
+                {
+                    if (n && !(n % volume._sectors_per_cluster))
+                    {
+                        // the next cluster of the directory is wherever the FAT says
+                        fat_sectors_of(first_cluster + (n / volume._sectors_per_cluster) - 1);
+                    }
+                    sectors.push_back(volume.cluster_to_lba(first_cluster) + n);
+                }
+            }
+
+            std::sort(sectors.begin(), sectors.end());
+            return size_t(std::unique(sectors.begin(), sectors.end()) - sectors.begin());
+        }
+
+        size_t lookup_sectors(const plan_t& plan, const fs_t::file_t* file)
+        {
+            return with_fat_traits(plan._volume._fat_bits, [&](auto traits) { return lookup_sectors<decltype(traits)>(plan, file); });
+        }
+
+        template<typename traits_t>
+        System::status_or_t<volume_t> create_fat_partition(disk_sector_writer_t* writer, const plan_t& plan)
+        {
+            if (!writer->image().good() || writer->image().total_sectors() != plan._image_sectors || writer->get_beg_lba() != plan._partition_lba)
+                return System::Code::FAILED_PRECONDITION;
+
+            const auto& volume = plan._volume;
+            const auto total_sectors = plan._partition_sectors;
+            const auto* volumeLabel = volume._label.c_str();
+            const auto size = static_cast<unsigned long long>(total_sectors * kSectorSizeBytes);
+
+            // =======================================================================================
+            // boot sector
+            //
+            fat_boot_sector_t boot_sector;
+            memset(&boot_sector, 0, sizeof boot_sector);
+            boot_sector._bpb._bytes_per_sector = kSectorSizeBytes;
+            boot_sector._bpb._num_fats = uint8_t(volume._num_fats);
+            boot_sector._bpb._media_descriptor = kMediaDescriptor;
+            // this isn't used, but it should still be valid
+            boot_sector._jmp[0] = kLongJmp;
+
+            // we need to specify geometry information (heads, cylinders, and sectors per track) for the MBR to be valid
+            // so we calculate these values according to the table https://en.wikipedia.org/wiki/Logical_block_addressing#LBA-assisted_translation        
+            boot_sector._bpb._sectors_per_track = 63;
+            if (size <= 0x1f800000)
+            {
+                boot_sector._bpb._num_heads = 16;
+            }
+            else if (size <= 0x3f000000)
+            {
+                boot_sector._bpb._num_heads = 32;
+            }
+            else if (size <= 0x7e000000)
+            {
+                boot_sector._bpb._num_heads = 64;
+            }
+            else if (size <= 0xfc000000)
+            {
+                boot_sector._bpb._num_heads = 128;
+            }
+            else
+            {
+                // maxed out, can't go higher
+                boot_sector._bpb._num_heads = 255;
+            }
+
+            // the extended bpb depends on the type of FAT
+            union
+            {
+                fat16_extended_bpb    _fat16;
+                fat32_extended_bpb    _fat32;
+            }
+            extended_bpb{};
+
+            char* extended_bpb_ptr = nullptr;
+            size_t extended_bpb_size = 0;
+
+            if constexpr (traits_t::kType != fat_type::kFat32)
+            {
+                //TODO: anything other than FAT32 is not allowed for UEFI bootable media so we need to warn against this
+
+                // FAT12 and FAT16 share the boot sector layout
+                // anything not set defaults to 0
+                memset(&extended_bpb._fat16, 0, sizeof extended_bpb._fat16);
+
+                if (total_sectors < 0x1000)
+                {
+                    // total_sectors32 = 0
+                    boot_sector._bpb._total_sectors16 = total_sectors & 0xffff;
+                }
+                else
+                {
+                    // total_sectors16 = 0
+                    boot_sector._bpb._total_sectors32 = total_sectors;
+                }
+
+                boot_sector._bpb._reserved_sectors = uint16_t(volume._reserved_sectors);
+                boot_sector._bpb._root_entry_count = uint16_t(kFat16RootEntryCount);
+                extended_bpb._fat16._drive_num = 0x80;
+                extended_bpb._fat16._boot_sig = 0x29;
+                extended_bpb._fat16._volume_serial = utils::uuid::rand_int();
+                //NOTE: this must match what is set in the root directory below
+                memset(extended_bpb._fat16._volume_label, 0x20, sizeof extended_bpb._fat16._volume_label);
+                memcpy(extended_bpb._fat16._volume_label, volumeLabel, std::min(sizeof extended_bpb._fat16._volume_label, strlen(volumeLabel)));
+                memcpy(extended_bpb._fat16._file_sys_type, traits_t::kType == fat_type::kFat12 ? kFat12FsType : kFat16FsType, sizeof kFat16FsType);
+
+                boot_sector._bpb._sectors_per_cluster = uint8_t(volume._sectors_per_cluster);
+
+                extended_bpb_ptr = reinterpret_cast<char*>(&extended_bpb._fat16);
+                extended_bpb_size = sizeof extended_bpb._fat16;
+
+                if (_verbose)
+                {
+                    std::cout << "\tfilesystem is FAT" << volume._fat_bits << "\n";
+                }
+            }
+            else
+            {
+                memset(&extended_bpb._fat32, 0, sizeof extended_bpb._fat32);
+
+                // total_sectors16 = 0
+                boot_sector._bpb._total_sectors32 = total_sectors;
+                boot_sector._bpb._reserved_sectors = uint16_t(volume._reserved_sectors);
+
+                extended_bpb._fat32._flags = 0;				    // FATs are mirrored
+                extended_bpb._fat32._root_cluster = 2;			// data cluster where the root directory resides, this is always 2 for FAT32 and it maps to the first sector of the data area (see below)
+                extended_bpb._fat32._information_sector = 1;
+                extended_bpb._fat32._phys_drive_number = 0x80;	    // standard hardisk ID
+                extended_bpb._fat32._ext_boot_signature = 0x29;     // indicates that volume ID, volume label, and file system type, are present. NOTE: volume label is ignored 
+                extended_bpb._fat32._volume_id = utils::uuid::rand_int();
+                //NOTE: this must match what is set in the root directory below
+                memset(extended_bpb._fat32._volume_label, 0x20, sizeof extended_bpb._fat32._volume_label);
+                memcpy(extended_bpb._fat32._volume_label, volumeLabel, std::min(sizeof extended_bpb._fat32._volume_label, strlen(volumeLabel)));
+                memcpy(extended_bpb._fat32._file_system_type, kFat32FsType, sizeof kFat32FsType);
+
+                boot_sector._bpb._sectors_per_cluster = uint8_t(volume._sectors_per_cluster);
+
+                extended_bpb_ptr = reinterpret_cast<char*>(&extended_bpb._fat32);
+                extended_bpb_size = sizeof extended_bpb._fat32;
+
+                if (_verbose)
+                {
+                    std::cout << "\tfilesystem is FAT32\n";
+                }
+            }
+
+            if constexpr (traits_t::kType == fat_type::kFat32)
+            {
+                boot_sector._bpb._sectors_per_fat16 = 0;
+                extended_bpb._fat32._sectors_per_fat = uint32_t(volume._sectors_per_fat);
+            }
+            else
+            {
+                boot_sector._bpb._sectors_per_fat16 = uint16_t(volume._sectors_per_fat & 0xffff);
+            }
+
+            // see MS fat documentation, the type of FAT is determined by the number of clusters alone
+            assert((volume._fat_bits == 12) == (volume._data_clusters <= kFat12MaxClusters));
+            assert((volume._fat_bits == 32) == (volume._data_clusters > kFat16MaxClusters));
+            memcpy(boot_sector._oem_name, kFatOemName, sizeof kFatOemName);
+
+            auto* sector = writer->blank_sector();
+            memcpy(sector, &boot_sector, sizeof boot_sector);
+            memcpy(sector + sizeof boot_sector, extended_bpb_ptr, extended_bpb_size);
+            reinterpret_cast<uint16_t*>(sector + 510)[0] = kMBRSignature;            
+            if (!writer->write_sector())
+            {
+                return System::Code::INTERNAL;
+            }
+
+            // =======================================================================================
+            // FATs
+            //
+            // a new image reads as zeros, so only the part of the FAT that is in use needs to be written to it. 
+            // an existing image may have anything in the rest of it
+            std::vector<char> padded_fat;
+            const auto* fat = plan._fat.data();
+            auto fat_sectors = plan._fat.size() / kSectorSizeBytes;
+            if (!writer->image().fresh())
+            {
+                padded_fat.resize(volume._sectors_per_fat * kSectorSizeBytes);
+                memcpy(padded_fat.data(), plan._fat.data(), plan._fat.size());
+                fat = padded_fat.data();
+                fat_sectors = volume._sectors_per_fat;
+            }
+            // every copy is the same
+            for (const auto& extent : plan._extents)
+            {
+                if (extent._kind == extent_t::kind_t::kFat)
+                {
+                    writer->seek_from_beg(extent._lba - plan._partition_lba);
+                    if (!writer->write_sectors_from(fat, fat_sectors))
+                    {
+                        return System::Code::UNAVAILABLE;
+                    }
+                }
+            }
+
+            if constexpr (traits_t::kType == fat_type::kFat32)
+            {
+                // =======================================================================================
+                // FSInfo (fat32 only)
+                //
+                sector = writer->blank_sector();
+                auto* fsinfo = reinterpret_cast<fat32_fsinfo*>(sector);
+                fsinfo->_lead_sig = kFsInfoLeadSig;
+                fsinfo->_struc_sig = kFsInfoStrucSig;
+                fsinfo->_tail_sig = kFsInfoTailSig;
+                // clusters are allocated linearly, so everything after the last one used is free
+                fsinfo->_free_count = uint32_t(volume._data_clusters - plan._used_clusters);
+                fsinfo->_next_free = uint32_t(plan._end_cluster);
+
+                writer->seek_from_beg(extended_bpb._fat32._information_sector);
+                writer->write_sector();
+            }
+
+            if (_align_bytes)
+            {
+                // what aligning costs; the partition moved up from the first usable LBA, reserved sectors in front of the FATs, and clusters skipped between files
+                const auto partition_padding = plan._partition_lba - gpt::kFirstUsableLba;
+                const auto reserved_padding = volume._reserved_sectors - (traits_t::kType == fat_type::kFat32 ? kReservedSectorCount : 1);
+                const auto skipped_clusters = (plan._end_cluster - 2) - plan._used_clusters;
+                std::cout << "\tdata aligned to " << _align_bytes << " bytes, padding: " << (partition_padding + reserved_padding) * kSectorSizeBytes 
+                    << " bytes before the data area and " << skipped_clusters * volume._sectors_per_cluster * kSectorSizeBytes << " between files\n";
+            }
+
+            // =======================================================================================
+            // directories and files
+            //
+            // where they go was planned with the FAT, see plan_image
+
+            const auto contents_result = write_contents<traits_t>(writer, plan);
+            if (!contents_result)
+            {
+                return contents_result.error_code();
+            }
+
+            return volume;
+        }
+
+        System::status_or_t<volume_t> create_fat_partition(disk_sector_writer_t* writer, const plan_t& plan)
+        {
+            return with_fat_traits(plan._volume._fat_bits, [&](auto traits) { return create_fat_partition<decltype(traits)>(writer, plan); });
+        }
+
+        template<typename traits_t>
+        System::status_or_t<size_t> update_fat_partition(disk_sector_writer_t* writer, const char* volumeLabel, fs_t& fs, build_manifest_t& manifest)
+        {
+            const auto& volume = manifest._volume;
+            if (!writer->image().good() || writer->image().total_sectors() != manifest._image_sectors || writer->get_beg_lba() != manifest._partition_lba
+                || manifest._sectors_per_cluster != _sectors_per_cluster || manifest._align_bytes != _align_bytes
+                || volume._label != volumeLabel || fs._index.size() != manifest._entries.size())
+            {
+                return System::Code::FAILED_PRECONDITION;
+            }
+
+            // make sure the image still is what the manifest says it is
+            disk_sector_reader_t reader{ writer->image() };
+            if (!reader.set_beg(manifest._partition_lba) || !reader.read_sector())
+            {
+                return System::Code::FAILED_PRECONDITION;
+            }
+            const auto* boot_sector = reinterpret_cast<const fat_boot_sector_t*>(reader.sector());
+            const auto* extended_bpb32 = reinterpret_cast<const fat32_extended_bpb*>(boot_sector + 1);
+            const auto sectors_per_fat = boot_sector->_bpb._sectors_per_fat16 ? boot_sector->_bpb._sectors_per_fat16 : extended_bpb32->_sectors_per_fat;
+            const auto information_sector = extended_bpb32->_information_sector;
+            if (boot_sector->_bpb._sectors_per_cluster != volume._sectors_per_cluster || boot_sector->_bpb._reserved_sectors != volume._reserved_sectors
+                || boot_sector->_bpb._num_fats != volume._num_fats || sectors_per_fat != volume._sectors_per_fat)
+            {
+                return System::Code::FAILED_PRECONDITION;
+            }
+
+            const auto bytes_per_cluster = volume._sectors_per_cluster * kSectorSizeBytes;
+            const auto clusters_for = [bytes_per_cluster](size_t size) {
+                return (size + (bytes_per_cluster - 1)) / bytes_per_cluster;
+            };
+
+            // match everything up with what was built last time, nothing is written until we know that the layout still fits
+            std::vector<std::pair<fs_t::file_t*, build_manifest_t::entry_t*>> changed;
+            for (auto& [path, entry] : fs._index)
+            {
+                const auto i = manifest._entries.find(std::string{ path });
+                if (i == manifest._entries.end() || i->second._is_dir != entry._is_dir)
+                {
+                    return System::Code::FAILED_PRECONDITION;
+                }
+
+                auto& built = i->second;
+                if (entry._is_dir)
+                {
+                    entry._content._dir->_start_cluster = built._start_cluster;
+                    continue;
+                }
+
+                auto* file = entry._content._file;
+                if (clusters_for(file->_size) > built._clusters)
+                {
+                    return System::Code::FAILED_PRECONDITION;
+                }
+                // a file keeps its clusters even when it is empty, in case it grows again
+                file->_start_cluster = file->_size ? built._start_cluster : 0;
+                file->_hash = built._hash;
+
+                const auto* source_path = file->_source_path ? file->_source_path : "";
+                if (file->_size == built._size && built._source_path == source_path && built._source_offset == file->_source_offset)
+                {
+                    if (file->_mtime && file->_mtime == built._mtime)
+                    {
+                        continue;
+                    }
+
+                    // touched, or in memory, but not necessarily changed
+                    const auto hash_result = hash_file(file);
+                    if (!hash_result)
+                    {
+                        return hash_result.error_code();
+                    }
+                    if (hash_result.value() == built._hash)
+                    {
+                        built._mtime = file->_mtime;
+                        continue;
+                    }
+                }
+                changed.emplace_back(file, &built);
+            }
+
+            // FAT sectors are patched in memory and then written to all the copies of the FAT
+            std::map<size_t, std::unique_ptr<char[]>> fat_sectors;
+            // the byte at offset in the FAT, nullptr if the sector it is in can't be read
+            const auto fat_byte = [&](size_t offset) -> uint8_t* {
+                const auto sector_index = offset / kSectorSizeBytes;
+                auto& sector = fat_sectors[sector_index];
+                if (!sector)
+                {
+                    if (!reader.seek_from_beg(volume._reserved_sectors + sector_index) || !reader.read_sector())
+                    {
+                        fat_sectors.erase(sector_index);
+                        return nullptr;
+                    }
+                    sector.reset(new char[kSectorSizeBytes]);
+                    memcpy(sector.get(), reader.sector(), kSectorSizeBytes);
+                }
+                return reinterpret_cast<uint8_t*>(sector.get()) + (offset % kSectorSizeBytes);
+            };
+            const auto set_fat_entry = [&](size_t cluster, typename traits_t::entry_t value) {
+                // a FAT12 entry can straddle two sectors, so each of its bytes is looked up on its own
+                const auto offset = traits_t::entry_offset(cluster);
+                uint8_t* at[traits_t::kEntryBytes];
+                uint8_t bytes[traits_t::kEntryBytes];
+                for (size_t n = 0; n < traits_t::kEntryBytes; ++n)
+                {
+                    at[n] = fat_byte(offset + n);
+                    if (!at[n])
+                    {
+                        return false;
+                    }
+                    bytes[n] = *at[n];
+                }
+                traits_t::set_entry(bytes, cluster, value);
+                for (size_t n = 0; n < traits_t::kEntryBytes; ++n)
+                {
+                    *at[n] = bytes[n];
+                }
+                return true;
+            };
+
+            if (_physical_order)
+            {
+                sort_by_source_location(changed, [](const auto& change) { return change.first; });
+            }
+            std::vector<fs_t::file_t*> changed_files;
+            for (const auto& [file, built] : changed)
+            {
+                if (file->_size)
+                {
+                    changed_files.push_back(file);
+                }
+            }
+            content_pipeline_t pipeline{ changed_files };
+
+            std::vector<const fs_t::dir_t*> changed_dirs;
+            int64_t freed_clusters = 0;
+            for (auto& [file, built] : changed)
+            {
+                if (_verbose)
+                {
+                    std::cout << "\tupdating " << file->_path << "\n";
+                }
+
+                if (!write_file(writer, volume, file, &pipeline))
+                {
+                    return System::Code::UNAVAILABLE;
+                }
+
+                if (file->_size != built->_size)
+                {
+                    // the size is in the directory entry
+                    changed_dirs.push_back(file->_parent);
+
+                    const auto old_clusters = clusters_for(built->_size);
+                    const auto new_clusters = clusters_for(file->_size);
+                    if (new_clusters != old_clusters)
+                    {
+                        // the chain is the first new_clusters of the ones allocated to the file, the rest are free
+                        for (size_t n = 0; n < built->_clusters; ++n)
+                        {
+                            const auto value = (n + 1) < new_clusters ? typename traits_t::entry_t(built->_start_cluster + n + 1) : ((n + 1) == new_clusters ? traits_t::kEOC : 0);
+                            if (!set_fat_entry(built->_start_cluster + n, value))
+                            {
+                                return System::Code::UNAVAILABLE;
+                            }
+                        }
+                        freed_clusters += int64_t(old_clusters) - int64_t(new_clusters);
+                    }
+                }
+
+                built->_size = file->_size;
+                built->_mtime = file->_mtime;
+                built->_hash = file->_hash;
+                built->_source_offset = file->_source_offset;
+                built->_source_path = file->_source_path ? file->_source_path : "";
+            }
+
+            std::sort(changed_dirs.begin(), changed_dirs.end());
+            changed_dirs.erase(std::unique(changed_dirs.begin(), changed_dirs.end()), changed_dirs.end());
+            dir_buffers_t dir_buffers;
+            for (const auto* dir : changed_dirs)
+            {
+                if (!write_dir_entries<traits_t>(writer, volume, dir, dir_buffers))
+                {
+                    return System::Code::UNAVAILABLE;
+                }
+            }
+
+            for (const auto& [sector_index, sector] : fat_sectors)
+            {
+                for (auto n = 0u; n < volume._num_fats; ++n)
+                {
+                    memcpy(writer->blank_sector(), sector.get(), kSectorSizeBytes);
+                    writer->seek_from_beg(volume._reserved_sectors + (n * volume._sectors_per_fat) + sector_index);
+                    if (!writer->write_sector())
+                    {
+                        return System::Code::UNAVAILABLE;
+                    }
+                }
+            }
+
+            if (traits_t::kType == fat_type::kFat32 && freed_clusters)
+            {
+                // the free count is only a hint, but if it is set it has to be right
+                if (!reader.seek_from_beg(information_sector) || !reader.read_sector())
+                {
+                    return System::Code::UNAVAILABLE;
+                }
+                auto* fsinfo = reinterpret_cast<fat32_fsinfo*>(writer->blank_sector());
+                memcpy(fsinfo, reader.sector(), kSectorSizeBytes);
+                if (fsinfo->_free_count != 0xffffffff)
+                {
+                    const auto free_count = int64_t(fsinfo->_free_count) + freed_clusters;
+                    fsinfo->_free_count = free_count < 0 ? 0xffffffff : uint32_t(free_count);
+                }
+                writer->seek_from_beg(information_sector);
+                if (!writer->write_sector())
+                {
+                    return System::Code::UNAVAILABLE;
+                }
+            }
+
+            return changed.size();
+        }
+
+        System::status_or_t<size_t> update_fat_partition(disk_sector_writer_t* writer, const char* volumeLabel, fs_t& fs, build_manifest_t& manifest)
+        {
+            const auto fat_bits = manifest._volume._fat_bits;
+            if (fat_bits != 12 && fat_bits != 16 && fat_bits != 32)
+            {
+                return System::Code::FAILED_PRECONDITION;
+            }
+            return with_fat_traits(fat_bits, [&](auto traits) { return update_fat_partition<decltype(traits)>(writer, volumeLabel, fs, manifest); });
+        }
+
+        namespace
+        {
+            // read lba of the partition through mount, counting it if it hasn't been read before
+            const char* read_counted(mount_point_t& mount, size_t lba, size_t read_cost_t::* kind)
+            {
+                if (!mount._reader->seek_from_beg(lba) || !mount._reader->read_sector())
+                {
+                    return nullptr;
+                }
+                if (mount._read.insert(lba).second)
+                {
+                    ++mount._cost._sectors;
+                    if (kind)
+                    {
+                        ++(mount._cost.*kind);
+                    }
+                    if (mount._cost._sectors == 1 || lba != mount._last_read + 1)
+                    {
+                        ++mount._cost._runs;
+                    }
+                    mount._last_read = lba;
+                }
+                return mount._reader->sector();
+            }
+
+            // the FAT entry of cluster, 0 if it can't be read
+            template<typename traits_t>
+            size_t next_cluster(mount_point_t& mount, size_t cluster)
+            {
+                const auto offset = traits_t::entry_offset(cluster);
+                const auto lba = mount._volume._reserved_sectors + (offset / kSectorSizeBytes);
+                const auto* sector = read_counted(mount, lba, &read_cost_t::_fat_sectors);
+                if (!sector)
+                {
+                    return 0;
+                }
+                uint8_t bytes[traits_t::kEntryBytes];
+                const auto in_sector = std::min(traits_t::kEntryBytes, kSectorSizeBytes - (offset % kSectorSizeBytes));
+                memcpy(bytes, sector + (offset % kSectorSizeBytes), in_sector);
+                if (in_sector < traits_t::kEntryBytes)
+                {
+                    // the entry straddles two FAT sectors
+                    sector = read_counted(mount, lba + 1, &read_cost_t::_fat_sectors);
+                    if (!sector)
+                    {
+                        return 0;
+                    }
+                    memcpy(bytes + in_sector, sector, traits_t::kEntryBytes - in_sector);
+                }
+                return traits_t::get_entry(bytes, cluster);
+            }
+
+            // the entry called name in the directory starting at cluster (0 for the FAT12/16 root directory)
+            template<typename traits_t>
+            System::status_or_t<fat_dir_entry_t> find_entry(mount_point_t& mount, size_t cluster, std::string_view name)
+            {
+                const auto& volume = mount._volume;
+                char16_t wanted[kLfnMaxChars];
+                const auto wanted_length = utils::utf8_to_utf16(name, wanted, kLfnMaxChars);
+                const auto upper = [](char16_t c) {
+                    return c < 0x80 ? char16_t(::toupper(c)) : c;
+                };
+
+                // the long name collected from the entries in front of the current one
+                char16_t long_name[kLfnMaxChars + kLfnCharsPerEntry];
+                size_t long_name_length = 0;
+                uint8_t long_name_checksum = 0;
+                auto have_long_name = false;
+
+                const auto root_sectors = volume._first_data_lba - volume._root_dir_lba;
+                for (size_t index = 0;; ++index)
+                {
+                    size_t lba = 0;
+                    if (!traits_t::kRootDirIsChain && !cluster)
+                    {
+                        if (index == root_sectors)
+                        {
+                            return System::Code::NOT_FOUND;
+                        }
+                        lba = volume._root_dir_lba + index;
+                    }
+                    else
+                    {
+                        if (index && !(index % volume._sectors_per_cluster))
+                        {
+                            cluster = next_cluster<traits_t>(mount, cluster);
+                            if (cluster >= traits_t::kEOC)
+                            {
+                                return System::Code::NOT_FOUND;
+                            }
+                        }
+                        if (cluster < 2 || cluster - 2 >= volume._data_clusters)
+                        {
+                            return System::Code::DATA_LOSS;
+                        }
+                        lba = volume.cluster_to_lba(cluster) + (index % volume._sectors_per_cluster);
+                    }
+
+                    const auto* sector = read_counted(mount, lba, &read_cost_t::_dir_sectors);
+                    if (!sector)
+                    {
+                        return System::Code::UNAVAILABLE;
+                    }
+                    fat_dir_entry_t entries[kSectorSizeBytes / sizeof(fat_dir_entry_t)];
+                    memcpy(entries, sector, kSectorSizeBytes);
+                    for (const auto& entry : entries)
+                    {
+                        if (!entry._short_name[0])
+                        {
+                            // nothing after this one
+                            return System::Code::NOT_FOUND;
+                        }
+                        if (entry._short_name[0] == 0xe5)
+                        {
+                            have_long_name = false;
+                            continue;
+                        }
+                        if (entry._attrib == uint8_t(fat_file_attribute::kLongName))
+                        {
+                            const auto& lfn = reinterpret_cast<const fat_lfn_entry_t&>(entry);
+                            const size_t order = lfn._order & ~kLfnLastEntry;
+                            if (lfn._order & kLfnLastEntry)
+                            {
+                                have_long_name = order > 0 && order * kLfnCharsPerEntry <= kLfnMaxChars + kLfnCharsPerEntry;
+                                long_name_length = order * kLfnCharsPerEntry;
+                                long_name_checksum = lfn._checksum;
+                            }
+                            if (have_long_name && order > 0 && order * kLfnCharsPerEntry <= long_name_length && lfn._checksum == long_name_checksum)
+                            {
+                                auto* part = long_name + ((order - 1) * kLfnCharsPerEntry);
+                                memcpy(part, lfn._name1, sizeof lfn._name1);
+                                memcpy(part + 5, lfn._name2, sizeof lfn._name2);
+                                memcpy(part + 11, lfn._name3, sizeof lfn._name3);
+                            }
+                            else
+                            {
+                                have_long_name = false;
+                            }
+                            continue;
+                        }
+                        if (entry._attrib & uint8_t(fat_file_attribute::kVolumeId))
+                        {
+                            have_long_name = false;
+                            continue;
+                        }
+
+                        auto matches = false;
+                        if (have_long_name && entry.lfn_checksum() == long_name_checksum)
+                        {
+                            const auto length = std::find(long_name, long_name + long_name_length, u'\0') - long_name;
+                            matches = size_t(length) == wanted_length && std::equal(wanted, wanted + wanted_length, long_name, [&](char16_t a, char16_t b) {
+                                return upper(a) == upper(b);
+                            });
+                        }
+                        have_long_name = false;
+                        if (!matches)
+                        {
+                            // "FOO     BAR" is FOO.BAR
+                            char short_name[13];
+                            size_t length = 0;
+                            for (size_t c = 0; c < 8 && entry._short_name[c] != ' '; ++c)
+                            {
+                                short_name[length++] = char(entry._short_name[c]);
+                            }
+                            if (entry._short_name[8] != ' ')
+                            {
+                                short_name[length++] = '.';
+                                for (size_t c = 8; c < 11 && entry._short_name[c] != ' '; ++c)
+                                {
+                                    short_name[length++] = char(entry._short_name[c]);
+                                }
+                            }
+                            matches = utils::equal_ignoring_case({ short_name, length }, name);
+                        }
+                        if (matches)
+                        {
+                            return entry;
+                        }
+                    }
                 }
             }
-
-            return true;
         }
 
-        System::status_or_t<bool> create_fat_partition(disk_sector_writer_t* writer, size_t total_sectors, const char* volumeLabel, const fs_t& fs)
+        System::status_or_t<mount_point_t> mount(disk_sector_reader_t* reader)
         {
-            if (!writer->image().good() || !total_sectors)
-                return System::Code::FAILED_PRECONDITION;
-
-            const auto size = static_cast<unsigned long long>(total_sectors * kSectorSizeBytes);
-
-            // =======================================================================================
-            // boot sector
-            //
-            fat_boot_sector_t boot_sector;
-            memset(&boot_sector, 0, sizeof boot_sector);
-            boot_sector._bpb._bytes_per_sector = kSectorSizeBytes;
-            boot_sector._bpb._num_fats = 2;				    // industry standard
-            boot_sector._bpb._media_descriptor = 0xf8;		// fixed disk partition type
-            // this isn't used, but it should still be valid
-            boot_sector._jmp[0] = kLongJmp;
-
-            // we need to specify geometry information (heads, cylinders, and sectors per track) for the MBR to be valid
-            // so we calculate these values according to the table https://en.wikipedia.org/wiki/Logical_block_addressing#LBA-assisted_translation        
-            boot_sector._bpb._sectors_per_track = 63;
-            if (size <= 0x1f800000)
-            {
-                boot_sector._bpb._num_heads = 16;
-            }
-            else if (size <= 0x3f000000)
+            mount_point_t mount;
+            mount._reader = reader;
+            const auto* sector = read_counted(mount, 0, nullptr);
+            if (!sector)
             {
-                boot_sector._bpb._num_heads = 32;
+                return System::Code::UNAVAILABLE;
             }
-            else if (size <= 0x7e000000)
+
+            fat_boot_sector_t boot_sector;
+            fat32_extended_bpb extended_bpb32;
+            memcpy(&boot_sector, sector, sizeof boot_sector);
+            memcpy(&extended_bpb32, sector + sizeof boot_sector, sizeof extended_bpb32);
+            const auto& bpb = boot_sector._bpb;
+            if (bpb._bytes_per_sector != kSectorSizeBytes || !bpb._sectors_per_cluster || (bpb._sectors_per_cluster & (bpb._sectors_per_cluster - 1))
+                || !bpb._reserved_sectors || !bpb._num_fats)
             {
-                boot_sector._bpb._num_heads = 64;
+                return System::Code::INVALID_ARGUMENT;
             }
-            else if (size <= 0xfc000000)
+
+            // the type follows from the number of clusters, see fatgen103
+            auto& volume = mount._volume;
+            const size_t total_sectors = bpb._total_sectors16 ? bpb._total_sectors16 : bpb._total_sectors32;
+            volume._sectors_per_cluster = bpb._sectors_per_cluster;
+            volume._reserved_sectors = bpb._reserved_sectors;
+            volume._num_fats = bpb._num_fats;
+            volume._sectors_per_fat = bpb._sectors_per_fat16 ? bpb._sectors_per_fat16 : extended_bpb32._sectors_per_fat;
+            volume._root_dir_lba = volume._reserved_sectors + (volume._num_fats * volume._sectors_per_fat);
+            volume._first_data_lba = volume._root_dir_lba + ((bpb._root_entry_count * sizeof(fat_dir_entry_t)) + (kSectorSizeBytes - 1)) / kSectorSizeBytes;
+            if (!volume._sectors_per_fat || total_sectors <= volume._first_data_lba)
             {
-                boot_sector._bpb._num_heads = 128;
+                return System::Code::INVALID_ARGUMENT;
             }
-            else
+            volume._data_clusters = (total_sectors - volume._first_data_lba) / volume._sectors_per_cluster;
+            volume._fat_bits = volume._data_clusters <= kFat12MaxClusters ? 12 : (volume._data_clusters <= kFat16MaxClusters ? 16 : 32);
+            if (volume._fat_bits == 32)
             {
-                // maxed out, can't go higher
-                boot_sector._bpb._num_heads = 255;
+                mount._root_cluster = extended_bpb32._root_cluster;
             }
 
-            // the extended bpb depends on the type of FAT
-            union
+            if (_verbose)
             {
-                fat16_extended_bpb    _fat16;
-                fat32_extended_bpb    _fat32;
+                std::cout << "\tmounted FAT" << volume._fat_bits << " volume, " << volume._data_clusters << " clusters of " << (volume._sectors_per_cluster * kSectorSizeBytes)
+                    << " bytes, data area at sector " << volume._first_data_lba << "\n";
             }
-            extended_bpb{};
-            fat_type type;
+            return mount;
+        }
 
-            char* extended_bpb_ptr = nullptr;
-            size_t extended_bpb_size = 0;
+        template<typename traits_t>
+        System::status_or_t<size_t> replay_read(mount_point_t& mount, std::string_view path)
+        {
+            const auto& volume = mount._volume;
 
-            // as per MS Windows' standard; any volume of size < 512MB shall be FAT16
-            if (size < 0x20000000)
+            // open it, one directory at a time
+            fat_dir_entry_t entry{};
+            auto is_dir = true;
+            auto cluster = mount._root_cluster;
+            while (!path.empty())
             {
-                //TODO: anything other than FAT32 is not allowed for UEFI bootable media so we need to warn against this
-
-                type = fat_type::kFat16;
-
-                // anything not set defaults to 0
-                memset(&extended_bpb._fat16, 0, sizeof extended_bpb._fat16);
-
-                if (total_sectors < 0x1000)
+                const auto separator = std::min(path.find_first_of("/\\"), path.size());
+                const auto name = path.substr(0, separator);
+                path.remove_prefix(std::min(separator + 1, path.size()));
+                if (name.empty())
                 {
-                    // total_sectors32 = 0
-                    boot_sector._bpb._total_sectors16 = total_sectors & 0xffff;
-                }
-                else
-                {
-                    // total_sectors16 = 0
-                    boot_sector._bpb._total_sectors32 = total_sectors;
+                    continue;
                 }
-
-                boot_sector._bpb._reserved_sectors = 1;		// as per standard for FAT16
-                boot_sector._bpb._root_entry_count = 512;		// as per standard for FAT16
-                extended_bpb._fat16._drive_num = 0x80;
-                extended_bpb._fat16._boot_sig = 0x29;
-                extended_bpb._fat16._volume_serial = utils::uuid::rand_int();
-                //NOTE: this must match what is set in the root directory below
-                memset(extended_bpb._fat16._volume_label, 0x20, sizeof extended_bpb._fat16._volume_label);
-                memcpy(extended_bpb._fat16._volume_label, volumeLabel, std::min(sizeof extended_bpb._fat16._volume_label, strlen(volumeLabel)));
-                memcpy(extended_bpb._fat16._file_sys_type, kFat16FsType, sizeof kFat16FsType);
-
-                // from MS' white paper on FAT
-                for (const auto& entry : kDiskTableFat16)
+                if (!is_dir)
                 {
-                    if (total_sectors <= entry._sector_limit)
-                    {
-                        boot_sector._bpb._sectors_per_cluster = entry._sectors_per_cluster;
-                        break;
-                    }
+                    return System::Code::NOT_FOUND;
                 }
-
-                extended_bpb_ptr = reinterpret_cast<char*>(&extended_bpb._fat16);
-                extended_bpb_size = sizeof extended_bpb._fat16;
-
-                if (_verbose)
+                const auto entry_result = find_entry<traits_t>(mount, cluster, name);
+                if (!entry_result)
                 {
-                    std::cout << "\tfilesystem is FAT16\n";
+                    return entry_result.error_code();
                 }
+                entry = entry_result.value();
+                is_dir = (entry._attrib & uint8_t(fat_file_attribute::kDirectory)) != 0;
+                // ".." of a directory in the root is 0, even on FAT32
+                cluster = is_dir && !entry.first_cluster() ? mount._root_cluster : entry.first_cluster();
             }
-            else
+            if (is_dir)
             {
-                type = fat_type::kFat32;
-
-                memset(&extended_bpb._fat32, 0, sizeof extended_bpb._fat32);
-
-                // total_sectors16 = 0
-                boot_sector._bpb._total_sectors32 = total_sectors;
-                boot_sector._bpb._reserved_sectors = 32;		// as per standard for FAT32, this is 16K
-
-                extended_bpb._fat32._flags = 0x80;				// no mirroring, FAT 0 is active	
-                extended_bpb._fat32._root_cluster = 2;			// data cluster where the root directory resides, this is always 2 for FAT32 and it maps to the first sector of the data area (see below)
-                extended_bpb._fat32._information_sector = 1;
-                extended_bpb._fat32._phys_drive_number = 0x80;	    // standard hardisk ID
-                extended_bpb._fat32._ext_boot_signature = 0x29;     // indicates that volume ID, volume label, and file system type, are present. NOTE: volume label is ignored 
-                extended_bpb._fat32._volume_id = utils::uuid::rand_int();
-                //NOTE: this must match what is set in the root directory below
-                memset(extended_bpb._fat32._volume_label, 0x20, sizeof extended_bpb._fat32._volume_label);
-                memcpy(extended_bpb._fat32._volume_label, volumeLabel, std::min(sizeof extended_bpb._fat32._volume_label, strlen(volumeLabel)));
-                memcpy(extended_bpb._fat32._file_system_type, kFat32FsType, sizeof kFat32FsType);
+                return System::Code::INVALID_ARGUMENT;
+            }
 
-                // from MS' white paper on FAT
-                for (const auto& entry : kDiskTableFat32)
+            // and read all of it, following its cluster chain
+            size_t left = entry._size;
+            while (left)
+            {
+                if (cluster < 2 || cluster - 2 >= volume._data_clusters)
                 {
-                    if (total_sectors <= entry._sector_limit)
+                    return System::Code::DATA_LOSS;
+                }
+                const auto lba = volume.cluster_to_lba(cluster);
+                for (size_t sector = 0; sector < volume._sectors_per_cluster && left; ++sector)
+                {
+                    if (!read_counted(mount, lba + sector, nullptr))
                     {
-                        boot_sector._bpb._sectors_per_cluster = entry._sectors_per_cluster;
-                        break;
+                        return System::Code::UNAVAILABLE;
                     }
+                    left -= std::min(left, kSectorSizeBytes);
                 }
-
-                extended_bpb_ptr = reinterpret_cast<char*>(&extended_bpb._fat32);
-                extended_bpb_size = sizeof extended_bpb._fat32;
-
-                if (_verbose)
+                if (left)
                 {
-                    std::cout << "\tfilesystem is FAT32\n";
+                    cluster = next_cluster<traits_t>(mount, cluster);
                 }
             }
-            //TODO: support FAT12 for small disks
+            return size_t(entry._size);
+        }
+
+        System::status_or_t<size_t> replay_read(mount_point_t& mount, std::string_view path)
+        {
+            return with_fat_traits(mount._volume._fat_bits, [&](auto traits) { return replay_read<decltype(traits)>(mount, path); });
+        }
 
-            const auto root_dir_sector_count = ((boot_sector._bpb._root_entry_count * 32) + (kSectorSizeBytes - 1)) / kSectorSizeBytes;
+    } // namespace fat
 
-            // this magic piece of calculation is taken from from MS' white paper where it states;
-            // "Do not spend too much time trying to figure out why this math works."
+    namespace
+    {
+        static constexpr char kBuildManifestHeader[] = "efibootgen build manifest 2";
 
-            auto sectors_per_fat = 0u;
-            const auto tmp1 = static_cast<unsigned long long>(total_sectors - (boot_sector._bpb._reserved_sectors + root_dir_sector_count));
-            auto tmp2 = (256 * boot_sector._bpb._sectors_per_cluster) + boot_sector._bpb._num_fats;
-            if (type == fat_type::kFat32)
+        // split line into (up to) count tab separated fields, returns the number of fields found
+        size_t split_fields(std::string_view line, std::string_view* fields, size_t count)
+        {
+            size_t found = 0;
+            for (size_t start = 0; found < count && start <= line.size(); ++found)
             {
-                tmp2 /= 2;
+                const auto end = std::min(line.find('\t', start), line.size());
+                fields[found] = line.substr(start, end - start);
+                start = end + 1;
             }
-            const auto fatsz = (tmp1 + (tmp2 - 1)) / tmp2;
-            if (type == fat_type::kFat32)
+            return found;
+        }
+
+        template<typename T>
+        bool parse_field(std::string_view field, T& value, int base = 10)
+        {
+            const auto [end, ec] = std::from_chars(field.data(), field.data() + field.size(), value, base);
+            return ec == std::errc{} && end == field.data() + field.size();
+        }
+    }
+
+    void build_manifest_t::capture(const fs_t& fs, const fat::volume_t& volume, size_t image_sectors, size_t partition_lba)
+    {
+        _image_sectors = image_sectors;
+        _partition_lba = partition_lba;
+        _sectors_per_cluster = disktools::_sectors_per_cluster;
+        _align_bytes = disktools::_align_bytes;
+        _volume = volume;
+        _entries.clear();
+        _entries.reserve(fs._index.size());
+
+        const auto bytes_per_cluster = volume._sectors_per_cluster * kSectorSizeBytes;
+        for (const auto& [path, entry] : fs._index)
+        {
+            entry_t built;
+            built._is_dir = entry._is_dir;
+            if (entry._is_dir)
             {
-                boot_sector._bpb._sectors_per_fat16 = 0;
-                extended_bpb._fat32._sectors_per_fat = fatsz;
-                sectors_per_fat = fatsz;
+                built._start_cluster = entry._content._dir->_start_cluster;
+                built._clusters = fat::dir_clusters(entry._content._dir, bytes_per_cluster);
             }
             else
             {
-                boot_sector._bpb._sectors_per_fat16 = uint16_t(fatsz & 0xffff);
-                sectors_per_fat = fatsz;
+                const auto* file = entry._content._file;
+                built._start_cluster = file->_start_cluster;
+                built._clusters = (file->_size + (bytes_per_cluster - 1)) / bytes_per_cluster;
+                built._size = file->_size;
+                built._mtime = file->_mtime;
+                built._hash = file->_hash;
+                built._source_offset = file->_source_offset;
+                built._source_path = file->_source_path ? file->_source_path : "";
             }
+            _entries.emplace(path, std::move(built));
+        }
+    }
 
-            // see MS fat documentation for this size check, we don't support FAT12
-            const auto num_clusters = total_sectors / boot_sector._bpb._sectors_per_cluster;
-            memcpy(boot_sector._oem_name, kFatOemName, sizeof kFatOemName);
+    System::status_t build_manifest_t::save(const std::string& path) const
+    {
+        // written in full to a temporary first so that we never leave a partial manifest behind
+        const auto temp_path = path + ".tmp";
+        std::ofstream ofs{ temp_path, std::ios::binary | std::ios::trunc };
+        if (!ofs.is_open())
+        {
+            return System::Code::NOT_FOUND;
+        }
 
-            auto* sector = writer->blank_sector();
-            memcpy(sector, &boot_sector, sizeof boot_sector);
-            memcpy(sector + sizeof boot_sector, extended_bpb_ptr, extended_bpb_size);
-            reinterpret_cast<uint16_t*>(sector + 510)[0] = kMBRSignature;            
-            if (!writer->write_sector())
+        ofs << kBuildManifestHeader << "\n";
+        ofs << "image\t" << _image_sectors << "\t" << _partition_lba << "\n";
+        ofs << "options\t" << _sectors_per_cluster << "\t" << _align_bytes << "\n";
+        ofs << "volume\t" << _volume._fat_bits << "\t" << _volume._sectors_per_cluster << "\t" << _volume._reserved_sectors << "\t" << _volume._num_fats
+            << "\t" << _volume._sectors_per_fat << "\t" << _volume._root_dir_lba << "\t" << _volume._first_data_lba << "\t" << _volume._label << "\n";
+        for (const auto& [entry_path, entry] : _entries)
+        {
+            if (entry._is_dir)
             {
-                return System::Code::INTERNAL;
+                ofs << "d\t" << entry._start_cluster << "\t" << entry._clusters << "\t" << entry_path << "\n";
             }
-
-            if (type == fat_type::kFat32)
+            else
             {
-                // =======================================================================================
-                // FSInfo (fat32 only)
-                //
-                sector = writer->blank_sector();
-                // FSInfo
-                auto* fsinfo = reinterpret_cast<fat32_fsinfo*>(sector);
-                fsinfo->_lead_sig = kFsInfoLeadSig;
-                fsinfo->_struc_sig = kFsInfoStrucSig;
-                fsinfo->_tail_sig = kFsInfoTailSig;
-
-                writer->seek_from_beg(extended_bpb._fat32._information_sector);
-                writer->write_sector();
+                ofs << "f\t" << entry._start_cluster << "\t" << entry._clusters << "\t" << entry._size << "\t" << entry._mtime << "\t"
+                    << std::hex << entry._hash << std::dec << "\t" << entry._source_offset << "\t" << entry_path << "\t" << entry._source_path << "\n";
             }
+        }
+        ofs.close();
+        if (!ofs)
+        {
+            return System::Code::UNAVAILABLE;
+        }
 
-            // =======================================================================================
-            //
-
-            // first lba available for data storage relative to the start of the partition
-            const auto first_data_lba = boot_sector._bpb._reserved_sectors + (boot_sector._bpb._num_fats * sectors_per_fat) + root_dir_sector_count;
-            // lba of root dir. For FAT16 this comes before first_data_lba, for FAT32 they are identical
-            auto root_dir_start_lba = 0u;
+        std::error_code ec;
+        fs::rename(temp_path, path, ec);
+        return ec ? System::Code::UNAVAILABLE : System::Code::OK;
+    }
 
-            // 3 is the first available data cluster and is the one that will hold the BOOT directory
-            size_t next_cluster = 0u;
+    System::status_t build_manifest_t::load(const std::string& path)
+    {
+        std::ifstream ifs{ path, std::ios::binary };
+        if (!ifs.is_open())
+        {
+            return System::Code::NOT_FOUND;
+        }
 
-            // 2 reserved + 2 directories
-            //ZZZ:
-            auto bootx64_start_cluster = 0u;
-            const auto bootx64_num_clusters = 0u;
+        std::string line;
+        if (!std::getline(ifs, line) || line != kBuildManifestHeader)
+        {
+            return System::Code::INVALID_ARGUMENT;
+        }
 
-            if (type == fat_type::kFat16)
+        _entries.clear();
+        std::string_view fields[10];
+        auto have_image = false;
+        auto have_options = false;
+        auto have_volume = false;
+        while (std::getline(ifs, line))
+        {
+            const auto count = split_fields(line, fields, std::size(fields));
+            auto valid = false;
+            if (fields[0] == "image" && count == 3)
             {
-                write_fat16(writer, boot_sector, fs);
-                // for FAT16 the root directory is stored before the data area in a fixed size area (as in; it can't grow after it has been created)
-                root_dir_start_lba = boot_sector._bpb._reserved_sectors + (boot_sector._bpb._num_fats * boot_sector._bpb._sectors_per_fat16);
+                valid = parse_field(fields[1], _image_sectors) && parse_field(fields[2], _partition_lba);
+                have_image = valid;
             }
-            else
+            else if (fields[0] == "options" && count == 3)
             {
-                sector = writer->blank_sector();
+                valid = parse_field(fields[1], _sectors_per_cluster) && parse_field(fields[2], _align_bytes);
+                have_options = valid;
+            }
+            else if (fields[0] == "volume" && count == 9)
+            {
+                valid = parse_field(fields[1], _volume._fat_bits) && parse_field(fields[2], _volume._sectors_per_cluster) 
+                    && parse_field(fields[3], _volume._reserved_sectors) && parse_field(fields[4], _volume._num_fats)
+                    && parse_field(fields[5], _volume._sectors_per_fat) && parse_field(fields[6], _volume._root_dir_lba)
+                    && parse_field(fields[7], _volume._first_data_lba);
+                _volume._label = fields[8];
+                have_volume = valid;
+            }
+            else if (fields[0] == "d" && count == 4)
+            {
+                entry_t entry;
+                entry._is_dir = true;
+                valid = parse_field(fields[1], entry._start_cluster) && parse_field(fields[2], entry._clusters);
+                _entries.emplace(fields[3], std::move(entry));
+            }
+            else if (fields[0] == "f" && count == 9)
+            {
+                entry_t entry;
+                valid = parse_field(fields[1], entry._start_cluster) && parse_field(fields[2], entry._clusters) && parse_field(fields[3], entry._size)
+                    && parse_field(fields[4], entry._mtime) && parse_field(fields[5], entry._hash, 16) && parse_field(fields[6], entry._source_offset);
+                entry._source_path = fields[8];
+                _entries.emplace(fields[7], std::move(entry));
+            }
 
-                auto* fat32 = reinterpret_cast<uint32_t*>(sector);
-                const auto max_clusters_per_sector = kSectorSizeBytes / sizeof(uint32_t);
+            if (!valid)
+            {
+                return System::Code::DATA_LOSS;
+            }
+        }
 
-                fat32[0] = 0x0fffff00 | boot_sector._bpb._media_descriptor;
-                fat32[1] = kFat32EOC;
+        return have_image && have_options && have_volume ? System::Code::OK : System::Code::DATA_LOSS;
+    }
 
-                // root directory, EFI and EFI/BOOT directories reside in the first three clusters and only use one cluster each
-                fat32[2] = kFat32EOC;
-                fat32[3] = kFat32EOC;
-                fat32[4] = kFat32EOC;
+#ifdef __linux__
+    source_watcher_t::~source_watcher_t()
+    {
+        if (_fd >= 0)
+        {
+            close(_fd);
+        }
+    }
 
-                // first available cluster after the root directory is 3
-                next_cluster = 3;
-                bootx64_start_cluster = 5;
+    System::status_t source_watcher_t::add(const std::string& directory, bool recursive)
+    {
+        if (_fd < 0)
+        {
+            _fd = inotify_init1(IN_CLOEXEC);
+            if (_fd < 0)
+            {
+                return System::Code::UNAVAILABLE;
+            }
+        }
 
-                auto cluster_counter = bootx64_start_cluster;
-                auto fat_sector = boot_sector._bpb._reserved_sectors;
-                writer->seek_from_beg(fat_sector);
+        // compilers and linkers either write files in place or write a temporary and rename it
+        static constexpr uint32_t kEvents = IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO;
+        const auto add_watch = [this](const std::string& path) {
+            //NOTE: "" is the current directory, but we report changes in it without a leading "./", as the paths in a fs_t are
+            const auto wd = inotify_add_watch(_fd, path.empty() ? "." : path.c_str(), kEvents);
+            if (wd < 0)
+            {
+                return errno == ENOSPC ? System::Code::RESOURCE_EXHAUSTED : System::Code::NOT_FOUND;
+            }
+            _directories[wd] = path;
+            return System::Code::OK;
+        };
 
-                // each FAT entry points to the *next* cluster in the chain, hence the staggered start.
-                for (auto n = 1u; n < bootx64_num_clusters; ++n)
-                {
-                    //NOTE: FAT32 entries are only 28 bits, the upper 4 bits are reserved and since we are formatting the volume we get to set them to 0
-                    fat32[cluster_counter++] = (n + bootx64_start_cluster) & 0x0fffffff;
+        auto result = add_watch(directory);
+        if (result != System::Code::OK || !recursive)
+        {
+            return result;
+        }
 
-                    if (cluster_counter == max_clusters_per_sector)
-                    {
-                        if (n == (bootx64_num_clusters - 1))
-                        {
-                            fat32[cluster_counter] = kFat32EOC;
-                        }
+        std::error_code ec;
+        for (auto i = fs::recursive_directory_iterator(directory, ec); !ec && i != fs::recursive_directory_iterator(); i.increment(ec))
+        {
+            if (fs::is_directory(i->status()) && (result = add_watch(i->path().string())) != System::Code::OK)
+            {
+                return result;
+            }
+        }
+        return ec ? System::Code::NOT_FOUND : System::Code::OK;
+    }
 
-                        // next FAT sector
-                        writer->write_sector();
-                        ++fat_sector;
-                        fat32 = reinterpret_cast<uint32_t*>(writer->blank_sector());
-                        cluster_counter = 0;
-                    }
+    System::status_or_t<std::vector<std::string>> source_watcher_t::wait(unsigned debounce_ms)
+    {
+        std::vector<std::string> changed;
+        alignas(inotify_event) char buffer[4096];
+        auto timeout = -1;
+        _overflowed = false;
+        for (;;)
+        {
+            pollfd pfd{ _fd, POLLIN, 0 };
+            const auto ready = poll(&pfd, 1, timeout);
+            if (ready < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
                 }
+                return System::Code::UNAVAILABLE;
+            }
+            if (!ready)
+            {
+                // quiet for long enough
+                break;
+            }
 
-                if (cluster_counter)
+            const auto bytes = read(_fd, buffer, sizeof buffer);
+            if (bytes <= 0)
+            {
+                return System::Code::UNAVAILABLE;
+            }
+            for (auto* next = buffer; next < buffer + bytes;)
+            {
+                const auto* event = reinterpret_cast<const inotify_event*>(next);
+                // not for any directory (its wd is -1), events have been lost
+                _overflowed = _overflowed || (event->mask & IN_Q_OVERFLOW);
+                const auto i = _directories.find(event->wd);
+                if (i != _directories.end() && event->len)
                 {
-                    fat32[cluster_counter] = kFat32EOC;
-                    writer->write_sector();
+                    changed.push_back((fs::path{ i->second } / event->name).string());
                 }
-
-                // the root directory of a FAT32 volume is a normal file chain and can grow as large as it needs to be.
-                root_dir_start_lba = first_data_lba + ((extended_bpb._fat32._root_cluster - 2) * boot_sector._bpb._sectors_per_cluster);
+                next += sizeof(inotify_event) + event->len;
             }
+            timeout = int(debounce_ms);
+        }
 
-            // =======================================================================================
-            // directories and files
-            //
-            // the root directory comes first and resides inside the reserved area for FAT16 and in the first data cluster for FAT32
-            // subsequent directories (and files) are created linearly from free clusters.
+        std::sort(changed.begin(), changed.end());
+        changed.erase(std::unique(changed.begin(), changed.end()), changed.end());
+        return changed;
+    }
+#else
+    source_watcher_t::~source_watcher_t() = default;
 
-            write_fs_contents_to_disk(writer, root_dir_start_lba,
-                first_data_lba, boot_sector._bpb._sectors_per_cluster,
-                volumeLabel, fs);
+    System::status_t source_watcher_t::add(const std::string&, bool)
+    {
+        return System::Code::UNIMPLEMENTED;
+    }
 
-            //TESTING:
-            /*disk_sector_reader_t reader{writer->image()};
-            reader.set_beg(writer->get_beg_lba());
-            const auto mnt = mount(&reader, root_dir_start_lba, first_data_lba, boot_sector._bpb._sectors_per_cluster);*/
+    System::status_or_t<std::vector<std::string>> source_watcher_t::wait(unsigned)
+    {
+        return System::Code::UNIMPLEMENTED;
+    }
+#endif
 
-            return true;
+    // All things EFI GPT 
+    namespace gpt
+    {        
+        size_t partition_start_lba()
+        {
+            const auto align_sectors = std::max(_align_bytes / kSectorSizeBytes, size_t(1));
+            return ((kFirstUsableLba + (align_sectors - 1)) / align_sectors) * align_sectors;
         }
 
-#ifdef WORK_IN_PROGRESS
-        //WIP: this is is far from complete and currently just used for testing
-        struct fat16_mount_point_t
-        {
-            uint16_t        _root_dir[kSectorSizeBytes/sizeof(uint16_t)];
-        };        
-        System::status_or_t<mount_point_t> mount(disk_sector_reader_t* reader, size_t root_dir_start_lba, size_t first_data_lba, size_t sectors_per_cluster)
+        System::status_or_t<partition_info_t> find_efi_system_partition(disk_sector_reader_t* reader)
         {
-            //TODO: check boot sector etc.
-
-            if( _verbose )
-            {
-                std::cout << "\tmounting FAT root dir from sector " << root_dir_start_lba << ", cluster " << root_dir_start_lba/sectors_per_cluster << "\n";
-            }
-
-            reader->seek_from_beg(root_dir_start_lba);
-            if ( !reader->read_sector() )
+            if (!reader->seek_from_beg(1) || !reader->read_sector())
             {
-                return System::Code::INVALID_ARGUMENT;
+                return System::Code::UNAVAILABLE;
             }
-
-            auto* mount_point = new fat16_mount_point_t;
-            memcpy(mount_point->_root_dir, reader->sector(), kSectorSizeBytes);
-            const auto* dir_entry = reinterpret_cast<fat_dir_entry_t*>(mount_point->_root_dir);
-            if ( (dir_entry->_attrib & static_cast<uint8_t>(fat_file_attribute::kVolumeId)) == 0 )
+            gpt_header header;
+            memcpy(&header, reader->sector(), sizeof header);
+            if (header._signature != kEfiPartSignature || header._partition_entry_size < sizeof(gpt_partition_header) 
+                || (kSectorSizeBytes % header._partition_entry_size))
             {
                 return System::Code::NOT_FOUND;
             }
 
-            ++dir_entry;
-            //TODO: check valid
-            
-            while(dir_entry->_first_cluster_lo)
+            const size_t entries_per_sector = kSectorSizeBytes / header._partition_entry_size;
+            for (size_t index = 0; index < header._partition_entry_count; ++index)
             {
-                char name_buffer[12];           
-                dir_entry->get_name(name_buffer, 12);
-
-                if(dir_entry->_attrib & static_cast<uint8_t>(fat_file_attribute::kDirectory) )
+                if (!(index % entries_per_sector) && (!reader->seek_from_beg(header._partition_entry_lba + (index / entries_per_sector)) || !reader->read_sector()))
                 {
-                    if(_verbose)
-                    {
-                        std::cout << "\tdir \"" << name_buffer << "\", start cluster " << dir_entry->_first_cluster_lo << std::endl;
-                    }
-
-                    const auto lba = first_data_lba + (dir_entry->_first_cluster_lo-2)*sectors_per_cluster;
-                    reader->seek_from_beg(lba);
-                    reader->read_sector();
-                    dir_entry = reinterpret_cast<fat_dir_entry_t*>(reader->sector());
-                    // skip past . and the ++ below will skip past ..
-                    ++dir_entry;
+                    return System::Code::UNAVAILABLE;
                 }
-                else
+                gpt_partition_header partition;
+                memcpy(&partition, reader->sector() + ((index % entries_per_sector) * header._partition_entry_size), sizeof partition);
+                if (!memcmp(partition._type_guid, kEfiSystemPartitionUuid, sizeof kEfiSystemPartitionUuid))
                 {
-                    if(_verbose)
-                    {
-                        std::cout << "\tfile \"" << name_buffer << "\", start cluster " << dir_entry->_first_cluster_lo << ", size " << dir_entry->_size << std::endl;
-                    }
-
-                    if (strstr(name_buffer,"BOOT")!=nullptr )
-                    {
-                        const auto lba = first_data_lba + (dir_entry->_first_cluster_lo-2)*sectors_per_cluster;
-                        reader->seek_from_beg(lba);
-                        reader->read_sector();
-                        auto* data = reinterpret_cast<char*>(reader->sector());
-                        data = nullptr;
-                    }
+                    partition_info_t info;
+                    info._first_usable_lba = partition._start_lba;
+                    info._last_usable_lba = partition._end_lba;
+                    return info;
                 }
-
-                ++dir_entry;
             }
-
-            return mount_point;
+            return System::Code::NOT_FOUND;
         }
-#endif // WORK_IN_PROGRESS
-
-    } // namespace fat
 
-    // All things EFI GPT 
-    namespace gpt
-    {        
         System::status_or_t<partition_info_t> create_efi_boot_image(disk_sector_writer_t* writer)
         {
             // ===============================================
             // protective MBR
 
             // skip past legacy boot loader code area (446 bytes)
+            writer->seek_from_beg(0);
             auto* sector = writer->blank_sector();
             auto* mbr_prec = reinterpret_cast<mbr_partition_record*>(sector + 446);
             mbr_prec->_boot_indicator = 0;
@@ -1124,7 +4443,7 @@ namespace disktools
             //
             //  NOTE: the minimum size of the GPT entry array which is 16K (16K/512 = 32 + LBA0+LBA1 = 34)
             //  
-            gpt_header_ptr->_first_usable_lba = 34;
+            gpt_header_ptr->_first_usable_lba = kFirstUsableLba;
             // minus backup GPT + backup array
             gpt_header_ptr->_last_usable_lba = writer->image().last_lba() - 2;
 
@@ -1142,7 +4461,7 @@ namespace disktools
 
             memcpy(gpt_partition->_type_guid, kEfiSystemPartitionUuid, sizeof kEfiSystemPartitionUuid);
             utils::uuid::generate(gpt_partition->_part_guid);
-            gpt_partition->_start_lba = gpt_header_ptr->_first_usable_lba;
+            gpt_partition->_start_lba = partition_start_lba();
             gpt_partition->_end_lba = gpt_header_ptr->_last_usable_lba;
             // bit 0: required partition, can't be deleted
             gpt_partition->_attributes = 1;
@@ -1185,7 +4504,8 @@ namespace disktools
             // ===============================================
 
             partition_info_t info;
-            info._first_usable_lba = gpt_header_ptr->_first_usable_lba;
+            //NOTE: the partition, which starts after the first usable LBA if it is aligned
+            info._first_usable_lba = partition_start_lba();
             info._last_usable_lba = gpt_header_ptr->_last_usable_lba;
             
             return info;
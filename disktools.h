@@ -1,7 +1,14 @@
 #pragma once
 
 #include "status.h"
+#include <cstdio>
+#include <iosfwd>
 #include <map>
+#include <memory>
+#include <memory_resource>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
 #ifdef _WIN32
 #include <filesystem>
@@ -20,6 +27,16 @@ namespace disktools
     extern bool _preserve_case;
     // reformat an existing image (if exists)
     extern bool _reformat;
+    // update an existing image in place where possible, using the build manifest written next to it by the previous build
+    extern bool _update;
+    // read source files in the order they are stored on disk instead of the order they are laid out in the image
+    extern bool _physical_order;
+    // cluster size in sectors, or 0 to size clusters by the size of the volume as Microsoft's format does (see fat::optimal_sectors_per_cluster)
+    extern size_t _sectors_per_cluster;
+    // boundary (in bytes) that the partition, the FAT data area, and the contents of each file start on in the image, or 0 for none
+    extern size_t _align_bytes;
+    // threads that write the contents of files to the image at once, with 1 they are written in order as they are read
+    extern size_t _jobs;
 
     // ================================================================================================================
     // this is the *only* sector size we support here. UEFI does support other sector sizes but we don't bother and
@@ -68,10 +85,17 @@ namespace disktools
         {
             return _using_existing;
         }
+        // a new image reads as zeros wherever nothing has been written, so there is no need to write zeros to it
+        [[nodiscard]]
+        bool fresh() const
+        {
+            return !_using_existing;
+        }
         // open/create an image that can hold at least content_size bytes.
         // if reformat: if file exists and is big enough it will be overwritten, otherwise it will be truncated
         System::status_t open(const std::string& oName, size_t content_size, bool reformat);
 
+        std::string             _path;
         size_t                  _total_sectors = 0;
         std::fstream            _fs;
         bool                    _using_existing = false;
@@ -114,11 +138,19 @@ namespace disktools
         bool write_sector_index(size_t sector_index);
         // write count sectors
         bool write_sectors(size_t count);
+        // write count sectors from data instead of the current sector buffer
+        bool write_sectors_from(const char* data, size_t count);
+        // move past count sectors without writing them, leaving holes in a fresh image
+        bool skip_sectors(size_t count);
         
         disk_sector_image_t&        _image;
         char*                       _sector = nullptr;
         size_t                      _sectors_in_buffer = 1;
+        // sectors _sector has room for
+        size_t                      _sector_capacity = 0;
         std::ofstream::pos_type     _seek_beg{};
+        // sectors skipped instead of written
+        size_t                      _skipped_sectors = 0;
     };
 
     struct disk_sector_reader_t
@@ -157,15 +189,77 @@ namespace disktools
         std::ifstream::pos_type     _seek_beg{};
     };
 
+    // allocates objects in chunks so that building large trees doesn't cost a heap allocation per node.
+    // objects live until the pool itself is destroyed.
+    template<typename T>
+    struct node_pool_t
+    {
+        static constexpr size_t kNodesPerChunk = 1024;
+        using chunk_t = std::aligned_storage_t<sizeof(T) * kNodesPerChunk, alignof(T)>;
+
+        node_pool_t() = default;
+        node_pool_t(const node_pool_t&) = delete;
+        node_pool_t& operator=(const node_pool_t&) = delete;
+        ~node_pool_t()
+        {
+            for (auto& chunk : _chunks)
+            {
+                const auto count = &chunk == &_chunks.back() ? _used : kNodesPerChunk;
+                auto* nodes = reinterpret_cast<T*>(chunk.get());
+                for (auto n = 0u; n < count; ++n)
+                {
+                    nodes[n].~T();
+                }
+            }
+        }
+
+        template<typename... Args>
+        T* create(Args&&... args)
+        {
+            if (_chunks.empty() || _used == kNodesPerChunk)
+            {
+                _chunks.emplace_back(new chunk_t);
+                _used = 0;
+            }
+            auto* node = reinterpret_cast<T*>(_chunks.back().get()) + _used;
+            new (node) T(std::forward<Args>(args)...);
+            ++_used;
+            return node;
+        }
+
+        std::vector<std::unique_ptr<chunk_t>>   _chunks;
+        size_t                                  _used = 0;
+    };
+
     struct fs_t
     {
         struct dir_t;
+        // a range of data in a sparse file, anything not covered by an extent is a hole and reads as zeros
+        struct extent_t
+        {
+            size_t          _offset = 0;
+            size_t          _size = 0;
+        };
         struct file_t
         {
-            dir_t*          _parent;
-            const void*     _data;
-            size_t          _size;
-            size_t          _start_cluster;
+            dir_t*          _parent = nullptr;
+            // full path in the tree, e.g. "EFI/BOOT/BOOTX64.EFI"
+            std::string_view _path;
+            // contents are either held in memory or streamed from _source_path when the image is written
+            const void*     _data = nullptr;
+            const char*     _source_path = nullptr;
+            // offset of the contents in _source_path, e.g. for files inside archives
+            size_t          _source_offset = 0;
+            size_t          _size = 0;
+            // data extents of a sparse source (see map_sparse_sources) in ascending order, nullptr if it is all data
+            const extent_t* _extents = nullptr;
+            size_t          _extent_count = 0;
+            size_t          _start_cluster = 0;
+            // read by the firmware at startup, see mark_hot
+            bool            _hot = false;
+            // only used for incremental updates; last write time of _source_path (see stat_sources) and hash of the contents as written
+            int64_t         _mtime = 0;
+            uint64_t        _hash = 0;
         };
 
         struct dir_entry_t
@@ -184,23 +278,34 @@ namespace disktools
         };
 
         //NOTE: explicit comparison to support heterogenuous indexing pre C++20...
-        using dir_entries_t = std::map<std::string, dir_entry_t, std::less<>>;
+        //      the map nodes are allocated from the owning fs_t's _node_resource
+        using dir_entries_t = std::pmr::map<std::string, dir_entry_t, std::less<>>;
 
         struct dir_t
         {
-            dir_t() = default;
+            explicit dir_t(std::pmr::memory_resource* resource = std::pmr::get_default_resource())
+                : _entries{ resource }
+            {}
             ~dir_t() = default;
 
             std::string     _name;
+            // full path in the tree, "" for the root
+            std::string_view _path;
             dir_entries_t   _entries;
-            size_t          _start_cluster;
-            dir_t* _parent;
+            size_t          _start_cluster = 0;
+            dir_t* _parent = nullptr;
+            // something below it is read by the firmware at startup, see mark_hot
+            bool            _hot = false;
         };
 
         fs_t()
+            : _index{ &_node_resource }
+            , _root{ &_node_resource }
         {
             _root._name = "\\";
         }
+        fs_t(const fs_t&) = delete;
+        fs_t& operator=(const fs_t&) = delete;
 
         size_t size() const
         {
@@ -215,22 +320,103 @@ namespace disktools
         System::status_or_t<bool> add_dir(dir_t* parent, const std::string& sysRootPath);
         // create based on contents in sourcePath. NOTE: sourcePath itself is *not* included in the disk image
         System::status_or_t<bool> create_from_source(std::string_view sourcePath);
+        // create from several source directories in order, later layers replace files and directories of earlier ones with the same path
+        // and directories that exist in both are merged. Only metadata is read, so replaced files are never read.
+        System::status_or_t<bool> create_from_sources(const std::vector<std::string>& sourcePaths);
+        // remove an entry, and everything below it, from parent
+        void remove(dir_t* parent, std::string_view name);
+        // look up an entry by its full path in the tree, as stored; '/' separated and (unless _preserve_case) upper case.
+        // e.g. "EFI/BOOT/BOOTX64.EFI". O(1), regardless of the depth of the path or size of the tree.
+        System::status_or_t<dir_entry_t> find(std::string_view path) const;
+        // mark the entry at path, and the directories it is in, as read by the firmware at startup; they are laid out before anything else 
+        // and their directory entries come first (see fat::plan_image). marking a directory marks everything in it too. path is matched 
+        // ignoring case, as firmware does. false if there is no such entry
+        bool mark_hot(std::string_view path);
         System::status_or_t<dir_t*> create_directory(dir_t* parent, std::string name_);
         System::status_or_t<dir_t*> create_directory(std::string name)
         {
             return create_directory(&_root, name);
         }
-        System::status_or_t<file_t*> create_file(dir_t* parent, const std::string& name_, const void* data,
+        System::status_or_t<file_t*> create_file(dir_t* parent, std::string_view name_, const void* data,
                                                  size_t size);
+        // create a file whose contents are read from source_path when the image is written. source_path must outlive this fs_t
+        System::status_or_t<file_t*> create_file_from_source(dir_t* parent, std::string_view name_, const char* source_path,
+                                                 size_t size);
+        System::status_or_t<file_t*> insert_file(dir_t* parent, std::string_view name_, const void* data, const char* source_path,
+                                                 size_t size);
+        // find or create all directories in path ("EFI/BOOT", '/' or '\\' separated) below parent
+        System::status_or_t<dir_t*> create_directories(dir_t* parent, std::string_view path);
+        // as above for a full path already in index form
+        System::status_or_t<dir_t*> create_indexed_directories(std::string_view path);
+        // full path of name in parent, kept for the lifetime of this fs_t
+        std::string_view child_path(const dir_t* parent, std::string_view name);
+        // create based on a manifest of "<source path>\t<destination path>" lines, files are streamed from their source when written.
+        // a line with an empty source creates a (possibly empty) directory; empty lines and lines starting with '#' are ignored
+        System::status_or_t<bool> create_from_manifest(std::string_view manifestPath);
+        // create based on the contents of a cpio "newc" archive (e.g. an initramfs), "-" reads it from stdin. 
+        // files are treated as for create_from_tar
+        System::status_or_t<bool> create_from_cpio(std::string_view cpioPath);
+        // create based on the contents of a ustar/pax archive, "-" reads it from stdin. 
+        // files in a tar file are streamed from their offsets in the archive, files read from stdin are copied to _spool and streamed from there
+        System::status_or_t<bool> create_from_tar(std::string_view tarPath);
+        // record the last write time of the source of every streamed file, used to detect what has changed since the last build
+        void stat_sources();
+        // find the data extents of sparse source files (where supported, using SEEK_DATA/SEEK_HOLE) so that holes are neither read nor written
+        void map_sparse_sources();
+        // as map_sparse_sources for a single file, e.g. when its source has changed since. whatever was mapped before is dropped.
+        // true if the file is sparse
+        bool map_sparse_source(file_t* file);
+        // where the contents of file start on the disk holding its source (using FIEMAP where supported, or else the inode number), 
+        // for reading sources in the order they are stored. 0 for files held in memory or if it can't be found
+        static uint64_t source_location(const file_t* file);
 
         void dump_contents(const dir_t* dir = nullptr, int depth = 0) const;
+        // a copy of str, kept for the lifetime of this fs_t
+        const char* store_string(std::string_view str);
+        // size bytes kept for the lifetime of this fs_t, small allocations are packed together
+        char* allocate_storage(size_t size);
+
+        // directories, files, and directory entries live as long as the fs_t and are allocated in bulk
+        std::pmr::monotonic_buffer_resource     _node_resource;
+        node_pool_t<dir_t>                      _dir_pool;
+        node_pool_t<file_t>                     _file_pool;
+        // every entry by its full path (see find), the keys are the _path members of the entries
+        std::pmr::unordered_map<std::string_view, dir_entry_t>  _index;
 
-        dir_t           _root{};
+        dir_t           _root;
         size_t          _size = 0;
+        // backing storage for manifests etc. that entries refer to
+        std::vector<std::unique_ptr<char[]>>    _storage;
+        char*                                   _storage_next = nullptr;
+        size_t                                  _storage_left = 0;
+        // the name of the file insert_file is adding, as stored. reused so that names don't each need a string of their own
+        std::string                             _name_buffer;
+
+        // a temporary file for the contents of archives read from stdin, which can't be read again when the image is written. 
+        // files refer to it by offset, as they do to an archive read from a file. it is removed when the fs_t is destroyed
+        struct spool_file_t
+        {
+            spool_file_t() = default;
+            spool_file_t(const spool_file_t&) = delete;
+            spool_file_t& operator=(const spool_file_t&) = delete;
+            ~spool_file_t();
+
+            // append size bytes of data, created on first use. false if it couldn't be written
+            bool append(const char* data, size_t size);
+
+            std::FILE*      _file = nullptr;
+            // what files are read from, on POSIX systems the file is unlinked as soon as it is created and this is its /dev/fd path
+            std::string     _path;
+            uint64_t        _size = 0;
+        };
+        spool_file_t    _spool;
     };
 
     namespace gpt
     {
+        // see create_efi_boot_image
+        inline constexpr size_t kFirstUsableLba = 34;
+
         struct partition_info_t
         {
             size_t  _first_usable_lba = 0;
@@ -251,17 +437,215 @@ namespace disktools
         // assumes writer is initialised and a blank image has been created.
         //
         System::status_or_t<partition_info_t> create_efi_boot_image(disk_sector_writer_t* writer);
+        // the LBA the partition starts at; the first usable one, or the first one on the _align_bytes boundary after it
+        size_t partition_start_lba();
+        // the first EFI system partition in the GPT of an existing image, as create_efi_boot_image describes it
+        System::status_or_t<partition_info_t> find_efi_system_partition(disk_sector_reader_t* reader);
     }
 
     namespace fat
     {
+        // where things are on a formatted partition, lbas are relative to the start of the partition
+        struct volume_t
+        {
+            unsigned    _fat_bits = 0;              // 12, 16, or 32
+            size_t      _sectors_per_cluster = 0;
+            size_t      _reserved_sectors = 0;      // i.e. the lba of the first FAT
+            size_t      _num_fats = 0;
+            size_t      _sectors_per_fat = 0;
+            size_t      _root_dir_lba = 0;
+            size_t      _first_data_lba = 0;
+            size_t      _data_clusters = 0;
+            std::string _label;
+
+            size_t cluster_to_lba(size_t cluster) const
+            {
+                return _first_data_lba + ((cluster - 2) * _sectors_per_cluster);
+            }
+        };
+
+        // the layout of a partition of total_sectors as create_fat_partition formats it. With sectors_per_cluster 0 the cluster size
+        // and FAT type depend on its size, otherwise the type is the one the number of clusters calls for (_fat_bits is 0 if there is none)
+        volume_t volume_layout(size_t total_sectors, size_t sectors_per_cluster = 0);
+        // the smallest image that fs fits in once its contents have been rounded up to whole clusters, of _sectors_per_cluster if set
+        size_t image_size_for(const fs_t& fs);
+        // the cluster size, in sectors, that gives the smallest image for fs
+        size_t optimal_sectors_per_cluster(const fs_t& fs);
+        // clusters taken by the entries of dir, which (except for the FAT16 root directory) is a cluster chain like a file
+        size_t dir_clusters(const fs_t::dir_t* dir, size_t bytes_per_cluster);
+
+        // a region of the image and what goes in it
+        struct extent_t
+        {
+            enum class kind_t : uint8_t
+            {
+                kProtectiveMbr,
+                kGptHeader,
+                kGptEntries,
+                kBackupGptEntries,
+                kBackupGptHeader,
+                kBootSector,
+                kFsInfo,
+                kFat,
+                kRootDir,
+                kDir,
+                kFile,
+            };
+
+            kind_t              _kind;
+            // in the image, not the partition
+            size_t              _lba = 0;
+            size_t              _sectors = 0;
+            // the directory of kRootDir and kDir extents, and the file of kFile ones
+            const fs_t::dir_t*  _dir = nullptr;
+            fs_t::file_t*       _file = nullptr;
+            // which copy of the FAT a kFat extent is
+            size_t              _copy = 0;
+        };
+
+        // where everything goes in an image, worked out before anything is written to it. 
+        // every region of the image is an extent, and the contents of the FAT are in _fat
+        struct plan_t
+        {
+            size_t                  _image_sectors = 0;
+            size_t                  _partition_lba = 0;
+            size_t                  _partition_sectors = 0;
+            volume_t                _volume;
+            // the sectors of one copy of the FAT up to the last one in use, as they are written; the rest of it is 0
+            std::vector<char>       _fat;
+            size_t                  _used_clusters = 0;
+            // the cluster after the last one allocated. Clusters before it that were skipped to align files are free
+            size_t                  _end_cluster = 0;
+            // in the order they are written; the GPT, the FAT metadata, directories depth first, and files in the order they are laid out
+            std::vector<extent_t>   _extents;
+        };
+
+        // plan the layout of an image of image_sectors holding fs. This allocates the clusters of its files and directories 
+        // (i.e. sets their _start_cluster) but doesn't touch the image
+        System::status_or_t<plan_t> plan_image(size_t image_sectors, const char* volumeLabel, fs_t& fs);
+        // the extent map of plan, one line per extent
+        void print_plan(const plan_t& plan, std::ostream& os);
+        // the distinct sectors a firmware FAT driver reads to find file in the planned image; the boot sector, the directory sectors it 
+        // searches on the way, and the FAT sectors it needs to follow directories that span more than one cluster
+        size_t lookup_sectors(const plan_t& plan, const fs_t::file_t* file);
+
+        // the default boot loaders of removable media, as the UEFI specification names them for each architecture. 
+        // efibootgen marks them hot (see fs_t::mark_hot) unless told otherwise
+        inline constexpr const char* kRemovableMediaLoaders[] = 
+        {
+            "EFI/BOOT/BOOTX64.EFI", "EFI/BOOT/BOOTIA32.EFI", "EFI/BOOT/BOOTAA64.EFI", "EFI/BOOT/BOOTARM.EFI", "EFI/BOOT/BOOTRISCV64.EFI",
+        };
+
         // ======================================================================================================================================================
         //
-        // format a partition as FAT16 or FAT32 depending on size requirements and initialise it with the contents of fs.
+        // format the partition of plan, as FAT12, FAT16, or FAT32, and initialise it with the contents it was planned with.
+        // writer has to be set to the start of the partition, which gpt::create_efi_boot_image creates
         // 
-        System::status_or_t<bool> create_fat_partition(disk_sector_writer_t* writer, size_t total_sectors, const char* volumeLabel, const fs_t& fs);
+        System::status_or_t<volume_t> create_fat_partition(disk_sector_writer_t* writer, const plan_t& plan);
+
+        // ======================================================================================================================================================
+        //
+        // reading an image back the way a firmware FAT driver does, to see what a layout costs it. The driver is assumed to read one sector at a 
+        // time and to keep what it has read, as the disk caches of firmware drivers do, so only the first read of each sector counts
+        //
+        // sectors read through a mount point, all of them distinct
+        struct read_cost_t
+        {
+            size_t  _sectors = 0;
+            // of _sectors, the ones that were FAT or directory sectors, the rest are the boot sector and the contents of files
+            size_t  _fat_sectors = 0;
+            size_t  _dir_sectors = 0;
+            // runs of consecutive sectors they were read in, i.e. one more than the number of seeks
+            size_t  _runs = 0;
+        };
+
+        struct mount_point_t
+        {
+            // set to the start of the partition
+            disk_sector_reader_t*       _reader = nullptr;
+            volume_t                    _volume;
+            // the first cluster of the FAT32 root directory
+            size_t                      _root_cluster = 0;
+            read_cost_t                 _cost;
+            std::unordered_set<size_t>  _read;
+            size_t                      _last_read = 0;
+        };
+
+        // read the boot sector of the FAT partition that reader has been set to (see disk_sector_reader_t::set_beg)
+        System::status_or_t<mount_point_t> mount(disk_sector_reader_t* reader);
+        // open path and read all of it, the way firmware loads a file. path is '/' or '\\' separated and matched ignoring case against the 
+        // long and short names, as firmware does. returns the size of the file, what it took to read it is added to mount._cost
+        System::status_or_t<size_t> replay_read(mount_point_t& mount, std::string_view path);
+    }
 
-        using mount_point_t = void*;
-        System::status_or_t<mount_point_t> mount(disk_sector_reader_t* reader, size_t root_dir_start_lba, size_t first_data_lba, size_t sectors_per_cluster);
+    // ================================================================================================================
+    // what the last build wrote where, kept in a text file next to the image so that the next build can update it in place
+    // instead of rebuilding it from scratch.
+    struct build_manifest_t
+    {
+        struct entry_t
+        {
+            bool            _is_dir = false;
+            size_t          _start_cluster = 0;
+            // clusters allocated to the entry, files can change size within these without changing the layout
+            size_t          _clusters = 0;
+            size_t          _size = 0;
+            int64_t         _mtime = 0;
+            uint64_t        _hash = 0;
+            size_t          _source_offset = 0;
+            std::string     _source_path;
+        };
+
+        // record the layout of a freshly built image
+        void capture(const fs_t& fs, const fat::volume_t& volume, size_t image_sectors, size_t partition_lba);
+        System::status_t load(const std::string& path);
+        System::status_t save(const std::string& path) const;
+
+        size_t                                      _image_sectors = 0;
+        size_t                                      _partition_lba = 0;
+        // the cluster size and alignment asked for (_sectors_per_cluster and _align_bytes) when the image was built, 
+        // an image built with others is rebuilt rather than updated
+        size_t                                      _sectors_per_cluster = 0;
+        size_t                                      _align_bytes = 0;
+        fat::volume_t                               _volume;
+        // by full path, as in fs_t::find
+        std::unordered_map<std::string, entry_t>    _entries;
+    };
+
+    // ================================================================================================================
+    // reports changes to source files so that an image can be kept up to date with them.
+    // only implemented for Linux (inotify), elsewhere add and wait return UNIMPLEMENTED
+    struct source_watcher_t
+    {
+        source_watcher_t() = default;
+        source_watcher_t(const source_watcher_t&) = delete;
+        source_watcher_t& operator=(const source_watcher_t&) = delete;
+        ~source_watcher_t();
+
+        // watch the contents of directory, and of every directory below it if recursive
+        System::status_t add(const std::string& directory, bool recursive);
+        // block until something changes, and then until nothing has changed for debounce_ms. 
+        // returns the paths of everything that was written, created, deleted, or moved, as directory/name. 
+        // if changes came faster than they could be reported some are missing, and _overflowed is set
+        System::status_or_t<std::vector<std::string>> wait(unsigned debounce_ms);
+
+        int                                     _fd = -1;
+        // set by wait when the kernel's event queue overflowed and events were dropped, what changed is then unknown
+        bool                                    _overflowed = false;
+        // watched directories by watch descriptor
+        std::unordered_map<int, std::string>    _directories;
+    };
+
+    namespace fat
+    {
+        // ======================================================================================================================================================
+        //
+        // update a partition created by create_fat_partition in place with the contents of fs, as recorded in manifest.
+        // only files whose contents have changed are rewritten, along with the directory and FAT sectors that refer to them.
+        // returns the number of files rewritten, or FAILED_PRECONDITION if fs doesn't fit the existing layout (files or directories
+        // have been added or removed, a file has outgrown its clusters, or another cluster size or alignment has been asked for) 
+        // and the image has to be rebuilt. manifest is updated to match.
+        //
+        System::status_or_t<size_t> update_fat_partition(disk_sector_writer_t* writer, const char* volumeLabel, fs_t& fs, build_manifest_t& manifest);
     }
 }
@@ -3,6 +3,11 @@
 #include "disktools.h"
 #include "status.h"
 #include "jopts.h"
+#include <algorithm>
+#include <cassert>
+#include <charconv>
+#include <set>
+#include <unordered_map>
 
 #define CHECK_REPORT_ABORT_ERROR(result)\
 if (!result)\
@@ -38,10 +43,22 @@ int main(int argc, char** argv)
     const auto bootimage_option = opts.add(option_constraint_t::kOptional, option_type_t::kText, "b,bootimage", "source kernel binary, must be BOOTX64.EFI. This creates a standard EFI/BOOOT/BOOTX64.EFI layout.", option_default_t::kNotPresent);
     const auto verbose_option = opts.add(option_constraint_t::kOptional, option_type_t::kFlag, "v,verbose", "output more information about the build process", option_default_t::kNotPresent);
     const auto case_option = opts.add(option_constraint_t::kOptional, option_type_t::kFlag, "c,case", "preserve case of filenames. Default converts to UPPER", option_default_t::kNotPresent);
-    const auto directory_option = opts.add(option_constraint_t::kOptional, option_type_t::kText, "d,directory", "source directory to copy to disk image", option_default_t::kNotPresent);
+    const auto directory_option = opts.add(option_constraint_t::kOptional, option_type_t::kText, "d,directory", "source directory to copy to disk image. Several directories can be layered (separated as in PATH), later ones replace files of earlier ones", option_default_t::kNotPresent);
+    const auto manifest_option = opts.add(option_constraint_t::kOptional, option_type_t::kText, "m,manifest", "manifest file of <source>TAB<destination> lines to copy to disk image", option_default_t::kNotPresent);
+    const auto tar_option = opts.add(option_constraint_t::kOptional, option_type_t::kText, "t,tar", "tar archive to copy to disk image, - reads it from stdin", option_default_t::kNotPresent);
+    const auto cpio_option = opts.add(option_constraint_t::kOptional, option_type_t::kText, "i,cpio", "cpio (newc) archive to copy to disk image, e.g. an initramfs, - reads it from stdin", option_default_t::kNotPresent);
     const auto output_option = opts.add(option_constraint_t::kRequired, option_type_t::kText, "o,output", "output path name of created disk image", option_default_t::kNotPresent);
     const auto label_option = opts.add(option_constraint_t::kOptional, option_type_t::kText, "l,label", "volume label of image", option_default_t::kPresent, "NOLABEL");
     const auto reformat_disk_option = opts.add(option_constraint_t::kOptional, option_type_t::kFlag, "f,format", "reformat existing boot image (if exists)", option_default_t::kNotPresent);
+    const auto watch_option = opts.add(option_constraint_t::kOptional, option_type_t::kFlag, "w,watch", "keep running and update the image whenever the sources change (Linux only). Implies -u", option_default_t::kNotPresent);
+    const auto physical_option = opts.add(option_constraint_t::kOptional, option_type_t::kFlag, "p,physical", "read source files in the order they are stored on disk, e.g. for sources on spinning disks. The image is the same either way", option_default_t::kNotPresent);
+    const auto cluster_option = opts.add(option_constraint_t::kOptional, option_type_t::kText, "k,cluster", "cluster size in bytes (512 to 32768), or auto for the one that gives the smallest image. Default sizes clusters by the size of the volume", option_default_t::kNotPresent);
+    const auto align_option = opts.add(option_constraint_t::kOptional, option_type_t::kText, "a,align", "start the partition, the data area, and the contents of each file on a boundary of this many bytes, e.g. 4K, 64K, or 1M", option_default_t::kNotPresent);
+    const auto hot_option = opts.add(option_constraint_t::kOptional, option_type_t::kText, "s,hot", "comma separated paths in the image of files (or directories) the firmware reads at startup, e.g. a kernel and its configuration. These, and EFI/BOOT/BOOTX64.EFI (or the loader of another architecture), are laid out first with their directory entries first. none lays out everything in order", option_default_t::kNotPresent);
+    const auto jobs_option = opts.add(option_constraint_t::kOptional, option_type_t::kText, "j,jobs", "number of threads writing the contents of files to the image at once, each to the clusters of its own files (not on Windows). Default 1", option_default_t::kNotPresent);
+    const auto dry_run_option = opts.add(option_constraint_t::kOptional, option_type_t::kFlag, "n,dry-run", "print where everything would go in the image, without writing it", option_default_t::kNotPresent);
+    const auto replay_option = opts.add(option_constraint_t::kOptional, option_type_t::kText, "r,replay", "comma separated paths in the image to open and read in full, in order, the way a firmware FAT driver does, and report the sectors that takes and the runs they are read in. Without any sources the existing image is read", option_default_t::kNotPresent);
+    const auto update_option = opts.add(option_constraint_t::kOptional, option_type_t::kFlag, "u,update", "update existing boot image in place, rewriting only what has changed since the last build with this option. Implies -f", option_default_t::kNotPresent);
     //NOTE: help is *always* available as -h or --help
 
     const auto parse_result = opts.parse(argc, argv);
@@ -60,89 +77,564 @@ int main(int argc, char** argv)
     disktools::_verbose = verbose_option.as<bool>();
     disktools::_preserve_case = case_option.as<bool>();
     disktools::_reformat = reformat_disk_option.as<bool>();
+    disktools::_update = update_option.as<bool>();
+    disktools::_physical_order = physical_option.as<bool>();
 
-    char* buffer = nullptr;
-    disktools::fs_t fs;
+    const auto optimise_clusters = cluster_option && cluster_option.as<std::string_view>() == "auto";
+    if (cluster_option && !optimise_clusters)
+    {
+        const auto cluster_size = cluster_option.as<std::string_view>();
+        size_t bytes = 0;
+        const auto [end, ec] = std::from_chars(cluster_size.data(), cluster_size.data() + cluster_size.size(), bytes);
+        if (ec != std::errc{} || end != cluster_size.data() + cluster_size.size() || bytes < disktools::kSectorSizeBytes 
+            || bytes > 0x8000 || (bytes & (bytes - 1)))
+        {
+            std::cerr << "*error: cluster size must be a power of 2 from 512 to 32768, or auto\n";
+            return -1;
+        }
+        disktools::_sectors_per_cluster = bytes / disktools::kSectorSizeBytes;
+    }
 
-    // load a bootimage from disk and create standard EFI\BOOT structure
-    if (bootimage_option)
+    if (align_option)
     {
-        auto dir_result = fs.create_directory("EFI");
-        CHECK_REPORT_ABORT_ERROR(dir_result);
-        dir_result = fs.create_directory(dir_result.value(), "BOOT");
-        CHECK_REPORT_ABORT_ERROR(dir_result);
+        const auto boundary = align_option.as<std::string_view>();
+        size_t bytes = 0;
+        const auto [end, ec] = std::from_chars(boundary.data(), boundary.data() + boundary.size(), bytes);
+        const auto suffix = boundary.substr(size_t(end - boundary.data()));
+        if (suffix == "K" || suffix == "k")
+        {
+            bytes *= 0x400;
+        }
+        else if (suffix == "M" || suffix == "m")
+        {
+            bytes *= 0x100000;
+        }
+        else if (!suffix.empty())
+        {
+            bytes = 0;
+        }
+        if (ec != std::errc{} || bytes < 0x1000 || bytes > 0x100000 || (bytes & (bytes - 1)))
+        {
+            std::cerr << "*error: alignment must be a power of 2 from 4K to 1M\n";
+            return -1;
+        }
+        disktools::_align_bytes = bytes;
+    }
 
-        const auto fpath = fs::path{ bootimage_option.as<const std::string&>() };
-        const auto dir_fname = fpath.stem().string() + " " + fpath.filename().extension().string().substr(1);        
-        // because a case insensitive comparison of std::string either requires a completely new type (traits) or a different algorithm...
-        if (xstricmp(dir_fname.c_str(), "BOOTX64 EFI") != 0)
+    if (jobs_option)
+    {
+        const auto jobs = jobs_option.as<std::string_view>();
+        size_t count = 0;
+        const auto [end, ec] = std::from_chars(jobs.data(), jobs.data() + jobs.size(), count);
+        if (ec != std::errc{} || end != jobs.data() + jobs.size() || !count || count > 256)
         {
-            std::cerr << "*error: bootimage must be called BOOTX64.EFI\n";
+            std::cerr << "*error: number of jobs must be from 1 to 256\n";
             return -1;
         }
-        std::ifstream ifs{ fpath.string(), std::ios::binary };
-        if (ifs.is_open())
+        disktools::_jobs = count;
+    }
+
+    // "base:overlay:..." (';' separated on Windows), each layer overrides paths in the ones before it
+    std::vector<std::string> layers;
+    if (directory_option)
+    {
+        const auto directories = directory_option.as<std::string_view>();
+        for (size_t start = 0; start <= directories.size();)
         {
-            ifs.seekg(0, std::ios::end);
-            const auto endpos = ifs.tellg();
-            ifs.seekg(0, std::ios::beg);
+            const auto end = std::min(directories.find(kPathListSeparator, start), directories.size());
+            if (end > start)
+            {
+                layers.emplace_back(directories.substr(start, end - start));
+            }
+            start = end + 1;
+        }
+    }
 
-            const auto size = size_t(endpos);
-            buffer = new char[size];
-            ifs.read(buffer, size);
-            ifs.close();
-            auto file_result = fs.create_file(dir_result.value(), "BOOTX64 EFI", buffer, size);
-            CHECK_REPORT_ABORT_ERROR(file_result);
+    // files the firmware reads at startup, laid out ahead of everything else
+    std::vector<std::string> hot_paths;
+    const auto hot_placement = !hot_option || hot_option.as<std::string_view>() != "none";
+    if (hot_option && hot_placement)
+    {
+        const auto paths = hot_option.as<std::string_view>();
+        for (size_t start = 0; start <= paths.size();)
+        {
+            const auto end = std::min(paths.find(',', start), paths.size());
+            if (end > start)
+            {
+                hot_paths.emplace_back(paths.substr(start, end - start));
+            }
+            start = end + 1;
         }
-        else
+    }
+
+    // files to replay the firmware reading once the image has been built
+    std::vector<std::string> replay_paths;
+    if (replay_option)
+    {
+        const auto paths = replay_option.as<std::string_view>();
+        for (size_t start = 0; start <= paths.size();)
         {
-            std::cerr << "*error: couldn't open " << fpath.string() << "\n";
-            return -1;
+            const auto end = std::min(paths.find(',', start), paths.size());
+            if (end > start)
+            {
+                replay_paths.emplace_back(paths.substr(start, end - start));
+            }
+            start = end + 1;
         }
     }
 
-    // copy whatever is in a given directory into the disk image
-    if (directory_option)
+    // build the fs_t tree from the sources; only metadata is read, except for archives read from stdin
+    const auto ingest = [&](disktools::fs_t& fs) -> int
     {
-        if (!fs.empty())
+        // load a bootimage from disk and create standard EFI\BOOT structure
+        if (bootimage_option)
+        {
+            auto dir_result = fs.create_directory("EFI");
+            CHECK_REPORT_ABORT_ERROR(dir_result);
+            dir_result = fs.create_directory(dir_result.value(), "BOOT");
+            CHECK_REPORT_ABORT_ERROR(dir_result);
+
+            const auto fpath = fs::path{ bootimage_option.as<const std::string&>() };
+            // because a case insensitive comparison of std::string either requires a completely new type (traits) or a different algorithm...
+            if (xstricmp(fpath.filename().string().c_str(), "BOOTX64.EFI") != 0)
+            {
+                std::cerr << "*error: bootimage must be called BOOTX64.EFI\n";
+                return -1;
+            }
+            std::error_code ec;
+            const auto size = fs::file_size(fpath, ec);
+            if (!ec)
+            {
+                // read when the image is written, like any other source file
+                auto file_result = fs.create_file_from_source(dir_result.value(), "BOOTX64.EFI", bootimage_option.as<const std::string&>().c_str(), size_t(size));
+                CHECK_REPORT_ABORT_ERROR(file_result);
+            }
+            else
+            {
+                std::cerr << "*error: couldn't open " << fpath.string() << "\n";
+                return -1;
+            }
+        }
+
+        // copy whatever is in a given directory into the disk image
+        if (directory_option)
+        {
+            if (!fs.empty())
+            {
+                std::cerr << "*error: you can't have both bootimage and directory options specified\n";
+                return -1;
+            }
+
+            auto create_result = fs.create_from_sources(layers);
+
+            if (disktools::_verbose)
+            {
+                std::cout << "\tloaded content from " << directory_option.as<std::string_view>() << "...\n";
+                fs.dump_contents(nullptr, 2);
+                std::cout << "\n";
+            }
+
+            CHECK_REPORT_ABORT_ERROR(create_result);
+        }
+
+        // copy the contents of a tar archive without extracting it first
+        if (tar_option)
+        {
+            auto create_result = fs.create_from_tar(tar_option.as<std::string_view>());
+
+            if (disktools::_verbose)
+            {
+                std::cout << "\tloaded tar archive " << tar_option.as<std::string_view>() << "...\n";
+                fs.dump_contents(nullptr, 2);
+                std::cout << "\n";
+            }
+
+            CHECK_REPORT_ABORT_ERROR(create_result);
+        }
+
+        // copy the contents of a cpio archive without unpacking it first
+        if (cpio_option)
+        {
+            auto create_result = fs.create_from_cpio(cpio_option.as<std::string_view>());
+
+            if (disktools::_verbose)
+            {
+                std::cout << "\tloaded cpio archive " << cpio_option.as<std::string_view>() << "...\n";
+                fs.dump_contents(nullptr, 2);
+                std::cout << "\n";
+            }
+
+            CHECK_REPORT_ABORT_ERROR(create_result);
+        }
+
+        // copy the files listed in a manifest, streamed directly from their source locations
+        if (manifest_option)
+        {
+            auto create_result = fs.create_from_manifest(manifest_option.as<std::string_view>());
+
+            if (disktools::_verbose)
+            {
+                std::cout << "\tloaded manifest " << manifest_option.as<std::string_view>() << "...\n";
+                fs.dump_contents(nullptr, 2);
+                std::cout << "\n";
+            }
+
+            CHECK_REPORT_ABORT_ERROR(create_result);
+        }
+
+        if (hot_placement)
+        {
+            for (const auto* loader : disktools::fat::kRemovableMediaLoaders)
+            {
+                fs.mark_hot(loader);
+            }
+        }
+        for (const auto& path : hot_paths)
+        {
+            if (!fs.mark_hot(path))
+            {
+                std::cerr << "*error: " << path << " is not in the image\n";
+                return -1;
+            }
+        }
+
+        // holes in sparse sources are neither read nor written
+        fs.map_sparse_sources();
+        return 0;
+    };
+
+    const auto& output = output_option.as<const std::string&>();
+    const auto& label = label_option.as<const std::string&>();
+
+    // what the last build wrote where, if it was built with -u
+    const auto build_manifest_path = output + ".build";
+    disktools::build_manifest_t build_manifest;
+    auto have_build_manifest = false;
+
+    // write fs to the image, in place if the contents still fit the layout of the existing image
+    const auto build = [&](disktools::fs_t& fs) -> int
+    {
+        if (optimise_clusters)
+        {
+            disktools::_sectors_per_cluster = disktools::fat::optimal_sectors_per_cluster(fs);
+        }
+
+        if (dry_run_option)
+        {
+            // the layout of a new image, the image itself isn't touched
+            const auto plan_result = disktools::fat::plan_image(disktools::fat::image_size_for(fs) / disktools::kSectorSizeBytes, label.c_str(), fs);
+            CHECK_REPORT_ABORT_ERROR(plan_result);
+            disktools::fat::print_plan(plan_result.value(), std::cout);
+            return 0;
+        }
+
+        disktools::disk_sector_image_t image;
+        const auto image_open_result = image.open(output, disktools::fat::image_size_for(fs), disktools::_reformat || disktools::_update);
+        CHECK_REPORT_ABORT_ERROR(image_open_result);
+
+        if (have_build_manifest && image.using_existing())
+        {
+            disktools::disk_sector_writer_t update_writer{ image };
+            update_writer.set_beg(build_manifest._partition_lba);
+            const auto update_result = disktools::fat::update_fat_partition(&update_writer, label.c_str(), fs, build_manifest);
+            if (update_result)
+            {
+                const auto save_result = build_manifest.save(build_manifest_path);
+                CHECK_REPORT_ABORT_ERROR(save_result);
+
+                std::cout << "\tboot image updated, " << update_result.value() << " files rewritten" << std::endl;
+                return 0;
+            }
+            if (update_result.error_code() != System::Code::FAILED_PRECONDITION)
+            {
+                CHECK_REPORT_ABORT_ERROR(update_result);
+            }
+            std::cout << "\tlayout of boot image has changed, rebuilding it\n";
+        }
+        if (disktools::_update)
         {
-            std::cerr << "*error: you can't have both bootimage and directory options specified\n";
+            // the manifest no longer describes the image once we start rebuilding it
+            std::error_code ec;
+            fs::remove(build_manifest_path, ec);
+            have_build_manifest = false;
+        }
+
+        // where everything goes, before anything is written
+        const auto plan_result = disktools::fat::plan_image(image.total_sectors(), label.c_str(), fs);
+        CHECK_REPORT_ABORT_ERROR(plan_result);
+        const auto& plan = plan_result.value();
+
+        // partition & format 
+
+        disktools::disk_sector_writer_t writer{image};
+        if (!image.using_existing())
+        {
+            create_blank_image(&writer);
+        }
+
+        auto part_result = disktools::gpt::create_efi_boot_image(&writer);
+        CHECK_REPORT_ABORT_ERROR(part_result);
+    
+        const auto part_info = part_result.value();
+        assert(part_info._first_usable_lba == plan._partition_lba && part_info.num_sectors() == plan._partition_sectors);
+        writer.set_beg(part_info._first_usable_lba);
+        auto fat_result = disktools::fat::create_fat_partition(&writer, plan);
+        CHECK_REPORT_ABORT_ERROR(fat_result);
+
+        if (writer._skipped_sectors)
+        {
+            std::cout << "\t" << writer._skipped_sectors * disktools::kSectorSizeBytes << " bytes of zeros left as holes\n";
+        }
+
+        if (disktools::_update)
+        {
+            build_manifest.capture(fs, fat_result.value(), image.total_sectors(), part_info._first_usable_lba);
+            const auto save_result = build_manifest.save(build_manifest_path);
+            CHECK_REPORT_ABORT_ERROR(save_result);
+            have_build_manifest = true;
+        }
+
+        std::cout << "\tboot image created" << std::endl;
+        return 0;
+    };
+
+    // read the files of replay_paths from the image with a cold cache, as firmware does when it boots from it
+    const auto replay = [&]() -> int
+    {
+        std::error_code ec;
+        if (!fs::exists(output, ec))
+        {
+            std::cerr << "*error: " << output << " doesn't exist\n";
             return -1;
         }
+        disktools::disk_sector_image_t image;
+        const auto image_open_result = image.open(output, 0, true);
+        CHECK_REPORT_ABORT_ERROR(image_open_result);
 
-        auto create_result = fs.create_from_source(directory_option.as<std::string_view>());
+        disktools::disk_sector_reader_t reader{ image };
+        const auto partition_result = disktools::gpt::find_efi_system_partition(&reader);
+        CHECK_REPORT_ABORT_ERROR(partition_result);
+        reader.set_beg(partition_result.value()._first_usable_lba);
+        auto mount_result = disktools::fat::mount(&reader);
+        CHECK_REPORT_ABORT_ERROR(mount_result);
+        auto& mount = mount_result.ref();
 
-        if (disktools::_verbose)
+        // each file costs what hasn't already been read for the ones before it
+        auto before = mount._cost;
+        for (const auto& path : replay_paths)
         {
-            std::cout << "\tloaded content from " << directory_option.as<std::string_view>() << "...\n";
-            fs.dump_contents(nullptr, 2);
-            std::cout << "\n";
+            const auto read_result = disktools::fat::replay_read(mount, path);
+            if (!read_result)
+            {
+                switch (read_result.error_code())
+                {
+                case System::Code::NOT_FOUND:
+                    std::cerr << "*error: " << path << " is not in the image\n";
+                    break;
+                case System::Code::INVALID_ARGUMENT:
+                    std::cerr << "*error: " << path << " is a directory\n";
+                    break;
+                default:
+                    std::cerr << "*error: couldn't read " << path << " from the image\n";
+                }
+                return -1;
+            }
+            const auto& cost = mount._cost;
+            std::cout << "\treading " << path << " (" << read_result.value() << " bytes) reads " << (cost._sectors - before._sectors) << " sectors, " 
+                << (cost._fat_sectors - before._fat_sectors) << " of the FAT and " << (cost._dir_sectors - before._dir_sectors) << " of directories, in " 
+                << (cost._runs - before._runs) << " runs\n";
+            before = cost;
         }
+        std::cout << "\t" << mount._cost._sectors << " sectors read in all, including the boot sector, in " << mount._cost._runs << " runs" << std::endl;
+        return 0;
+    };
 
-        CHECK_REPORT_ABORT_ERROR(create_result);
+    const auto have_sources = bootimage_option || directory_option || manifest_option || tar_option || cpio_option;
+    if (replay_option && !have_sources)
+    {
+        return replay();
     }
 
-    // partition & format 
+    if (watch_option)
+    {
+        // keeping the image up to date is what -u does
+        disktools::_update = true;
+    }
 
-    disktools::disk_sector_image_t image;
-    const auto image_open_result = image.open(output_option.as<const std::string&>(), fs.size(), disktools::_reformat);
-    CHECK_REPORT_ABORT_ERROR(image_open_result);
+    auto fs = std::make_unique<disktools::fs_t>();
+    if (ingest(*fs))
+    {
+        return -1;
+    }
 
-    disktools::disk_sector_writer_t writer{image};
-    if (!image.using_existing())
+    if (disktools::_update)
     {
-        create_blank_image(&writer);
+        fs->stat_sources();
+        have_build_manifest = build_manifest.load(build_manifest_path);
+        if (disktools::_verbose && !have_build_manifest)
+        {
+            std::cout << "\tno valid build manifest " << build_manifest_path << ", building image from scratch\n";
+        }
     }
 
-    auto part_result = disktools::gpt::create_efi_boot_image(&writer);
-    CHECK_REPORT_ABORT_ERROR(part_result);
-    
-    const auto part_info = part_result.value();
-    writer.set_beg(part_info._first_usable_lba);
-    auto fat_result = disktools::fat::create_fat_partition(&writer, part_info.num_sectors(), label_option.as<const std::string&>().c_str(), fs);
-    CHECK_REPORT_ABORT_ERROR(fat_result);
+    if (build(*fs))
+    {
+        return -1;
+    }
+
+    if (replay_option && !dry_run_option && replay())
+    {
+        return -1;
+    }
+
+    if (!watch_option || dry_run_option)
+    {
+        return 0;
+    }
+
+    // ==========================================================================================================
+    // watch the sources and update the image whenever they change, until we're killed
+
+    // changes to any of these mean that the tree has to be built again from scratch
+    std::set<std::string> inputs;
+    for (const auto* option : { &bootimage_option, &manifest_option, &tar_option, &cpio_option })
+    {
+        if (*option)
+        {
+            if (option->as<std::string_view>() == "-")
+            {
+                std::cerr << "*error: can't watch sources read from stdin\n";
+                return -1;
+            }
+            inputs.emplace(option->as<const std::string&>());
+        }
+    }
+
+    // the files streamed from each source path, and what to watch
+    std::unordered_map<std::string_view, std::vector<disktools::fs_t::file_t*>> sources;
+    std::unique_ptr<disktools::source_watcher_t> watcher;
+    const auto watch = [&]() -> int
+    {
+        sources.clear();
+        watcher = std::make_unique<disktools::source_watcher_t>();
+
+        // each layer is watched in full, since files can be added anywhere in it
+        for (const auto& layer : layers)
+        {
+            const auto watch_result = watcher->add(layer, true);
+            CHECK_REPORT_ABORT_ERROR(watch_result);
+        }
+
+        std::set<std::string> directories;
+        for (const auto& input : inputs)
+        {
+            directories.emplace(fs::path{ input }.parent_path().string());
+        }
+        for (const auto& [path, entry] : fs->_index)
+        {
+            if (!entry._is_dir && entry._content._file->_source_path)
+            {
+                auto& files = sources[entry._content._file->_source_path];
+                if (files.empty())
+                {
+                    directories.emplace(fs::path{ entry._content._file->_source_path }.parent_path().string());
+                }
+                files.push_back(entry._content._file);
+            }
+        }
+        for (const auto& directory : directories)
+        {
+            const auto watch_result = watcher->add(directory, false);
+            CHECK_REPORT_ABORT_ERROR(watch_result);
+        }
+        return 0;
+    };
+    if (watch())
+    {
+        return -1;
+    }
+
+    std::cout << "\twatching for changes...\n";
+    for (;;)
+    {
+        // wait for the compiler (or whatever is writing the sources) to finish
+        static constexpr unsigned kDebounceMs = 100;
+        const auto wait_result = watcher->wait(kDebounceMs);
+        CHECK_REPORT_ABORT_ERROR(wait_result);
+
+        // too much changed at once to know what, so everything is read again
+        auto rebuild = watcher->_overflowed;
+        auto changed = false;
+        if (rebuild)
+        {
+            std::cout << "\ttoo many changes to keep track of, reading the sources again\n";
+        }
+        for (const auto& path : wait_result.cref())
+        {
+            std::error_code ec;
+            const auto is_file = fs::is_regular_file(path, ec);
+            const auto i = sources.find(path);
+            if (inputs.count(path))
+            {
+                rebuild = true;
+            }
+            else if (i != sources.end())
+            {
+                if (!is_file)
+                {
+                    // deleted or replaced by a directory
+                    rebuild = true;
+                    continue;
+                }
+
+                // a modified source; update the files in place, the same way stat_sources would
+                const auto size = size_t(fs::file_size(path, ec));
+                if (ec)
+                {
+                    // gone again since it changed
+                    rebuild = true;
+                    continue;
+                }
+                const auto mtime = fs::last_write_time(path, ec).time_since_epoch().count();
+                for (auto* file : i->second)
+                {
+                    fs->_size = fs->_size - file->_size + size;
+                    file->_size = size;
+                    file->_mtime = ec ? 0 : int64_t(mtime);
+                    // where the holes are has changed along with it, reading only the old data extents would miss new data
+                    fs->map_sparse_source(file);
+                }
+                changed = true;
+            }
+            else if (fs::exists(path, ec))
+            {
+                // something new; only matters if it is inside one of the source directories
+                // (on a path component boundary, src2/x isn't inside src)
+                const auto is_separator = [](char c) { return c == '/' || c == '\\'; };
+                rebuild = rebuild || std::any_of(layers.begin(), layers.end(), [&](const std::string& layer) {
+                    return path.compare(0, layer.size(), layer) == 0 && 
+                        (path.size() == layer.size() || is_separator(path[layer.size()]) || (!layer.empty() && is_separator(layer.back())));
+                });
+            }
+        }
 
-    delete[] buffer;
+        if (rebuild)
+        {
+            if (disktools::_verbose)
+            {
+                std::cout << "\tsources have been added or removed, reading them again\n";
+            }
+            fs = std::make_unique<disktools::fs_t>();
+            if (ingest(*fs) || watch())
+            {
+                return -1;
+            }
+            fs->stat_sources();
+        }
 
-    std::cout << "\tboot image created" << std::endl;
+        if ((rebuild || changed) && build(*fs))
+        {
+            return -1;
+        }
+    }
 }
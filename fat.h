@@ -8,6 +8,7 @@ namespace disktools
 
         static constexpr uint8_t kFat32FsType[8] = { 'F','A','T','3','2',' ',' ',' ' };
         static constexpr uint8_t kFat16FsType[8] = { 'F','A','T','1','6',' ',' ',' ' };
+        static constexpr uint8_t kFat12FsType[8] = { 'F','A','T','1','2',' ',' ',' ' };
 
 #pragma pack(push,1)
         struct fat_bpb
@@ -87,11 +88,37 @@ namespace disktools
             uint16_t		_first_cluster_lo;
             uint32_t		_size;
 
+            // "FOO.BAR" -> "FOO     BAR", "." and ".." are stored as is
             void set_name(const char* name)
             {
-                const auto len = std::min<size_t>(sizeof _short_name, strlen(name));
                 memset(_short_name, ' ', sizeof _short_name);
-                memcpy(_short_name, name, len);
+                const auto* ext = name[0] != '.' ? strrchr(name, '.') : nullptr;
+                const auto stem_len = ext ? size_t(ext - name) : strlen(name);
+                memcpy(_short_name, name, std::min<size_t>(8, stem_len));
+                if (ext)
+                {
+                    memcpy(_short_name + 8, ext + 1, std::min<size_t>(3, strlen(ext + 1)));
+                }
+            }
+
+            // FAT32 cluster numbers are split in two halves, the high half is always 0 on FAT16
+            void set_first_cluster(size_t cluster)
+            {
+                _first_cluster_hi = uint16_t(cluster >> 16);
+                _first_cluster_lo = uint16_t(cluster & 0xffff);
+            }
+
+            size_t first_cluster() const
+            {
+                return (size_t(_first_cluster_hi) << 16) | _first_cluster_lo;
+            }
+
+            // volume labels use all 11 characters
+            void set_label(const char* label)
+            {
+                const auto len = std::min<size_t>(sizeof _short_name, strlen(label));
+                memset(_short_name, ' ', sizeof _short_name);
+                memcpy(_short_name, label, len);
             }
 
             void get_name(char* buffer, size_t buff_len) const
@@ -100,7 +127,32 @@ namespace disktools
                 memcpy(buffer, _short_name, 11);
                 buffer[11] = 0;                
             }
+
+            // ties the long name entries in front of this entry to it
+            uint8_t lfn_checksum() const
+            {
+                uint8_t sum = 0;
+                for (const auto c : _short_name)
+                {
+                    sum = uint8_t(((sum & 1) << 7) + (sum >> 1) + c);
+                }
+                return sum;
+            }
+        };
+
+        // VFAT long file name entry, these come in reverse order (the last part of the name first) in front of the short entry they belong to
+        struct fat_lfn_entry_t
+        {
+            uint8_t         _order;             // 1 based, kLfnLastEntry is set in the last one
+            uint16_t        _name1[5];          // UCS-2, the name is 0 terminated (unless it fills the last entry) and padded with 0xffff
+            uint8_t         _attrib;            // always kLongName
+            uint8_t         _type;              // always 0
+            uint8_t         _checksum;          // lfn_checksum of the short entry
+            uint16_t        _name2[6];
+            uint16_t        _first_cluster_lo;  // always 0
+            uint16_t        _name3[2];
         };
+        static_assert(sizeof(fat_lfn_entry_t) == sizeof(fat_dir_entry_t));
 
         struct fat32_fsinfo
         {
@@ -128,6 +180,7 @@ namespace disktools
 
         enum class fat_type
         {
+            kFat12,
             kFat16,
             kFat32,
         };
@@ -139,8 +192,132 @@ namespace disktools
         static constexpr uint32_t   kFsInfoTailSig = 0xaa550000;
         static constexpr uint32_t   kFat32EOC = 0x0ffffff8;
         static constexpr uint16_t   kFat16EOC = 0xfff8;
+        static constexpr uint16_t   kFat12EOC = 0x0ff8;
+        // the FAT type is determined by the number of data clusters alone, FAT12 below this and FAT16 from it
+        static constexpr size_t     kFat12MaxClusters = 4084;
+        static constexpr size_t     kFat16MaxClusters = 65524;
+        static constexpr size_t     kFat32MaxClusters = 0x0ffffff4;
+        // 32K clusters, 64K ones are not supported everywhere
+        static constexpr size_t     kMaxSectorsPerCluster = 64;
         static constexpr uint8_t    kShortJmp = 0xeb;
         static constexpr uint8_t    kLongJmp = 0xe9;
+        static constexpr uint8_t    kLfnLastEntry = 0x40;
+        static constexpr size_t     kLfnCharsPerEntry = 13;
+        static constexpr size_t     kLfnMaxChars = 255;
+
+        // what the types of FAT differ in, so that code can be compiled once for each of them instead of checking which one it 
+        // is working with as it goes. entry_t is an entry as it is held in memory
+        template<unsigned kFatBits>
+        struct fat_traits_t;
+
+        template<>
+        struct fat_traits_t<12>
+        {
+            using entry_t = uint16_t;
+            static constexpr unsigned   kBits = 12;
+            static constexpr fat_type   kType = fat_type::kFat12;
+            static constexpr entry_t    kEOC = kFat12EOC;
+            // the bits of an entry that are in use
+            static constexpr entry_t    kMask = 0x0fff;
+            // the root directory has an area of its own in front of the data area
+            static constexpr bool       kRootDirIsChain = false;
+            // bytes an entry is read from, from entry_offset on. FAT12 entries are packed in pairs in 3 bytes, so one can straddle two sectors
+            static constexpr size_t     kEntryBytes = 2;
+
+            static constexpr size_t entry_offset(size_t cluster)
+            {
+                return cluster + (cluster / 2);
+            }
+            // bytes of the FAT for the entries of clusters 0 up to count
+            static constexpr size_t fat_bytes(size_t count)
+            {
+                return ((count * 3) + 1) / 2;
+            }
+            static entry_t get_entry(const uint8_t* bytes, size_t cluster)
+            {
+                const auto pair = uint16_t(bytes[0] | (bytes[1] << 8));
+                return (cluster & 1) ? entry_t(pair >> 4) : entry_t(pair & kMask);
+            }
+            // the other half of the bytes belongs to the neighbouring entry and is kept
+            static void set_entry(uint8_t* bytes, size_t cluster, entry_t value)
+            {
+                if (cluster & 1)
+                {
+                    bytes[0] = uint8_t((bytes[0] & 0x0f) | (value << 4));
+                    bytes[1] = uint8_t(value >> 4);
+                }
+                else
+                {
+                    bytes[0] = uint8_t(value);
+                    bytes[1] = uint8_t((bytes[1] & 0xf0) | ((value >> 8) & 0x0f));
+                }
+            }
+        };
+
+        template<>
+        struct fat_traits_t<16>
+        {
+            using entry_t = uint16_t;
+            static constexpr unsigned   kBits = 16;
+            static constexpr fat_type   kType = fat_type::kFat16;
+            static constexpr entry_t    kEOC = kFat16EOC;
+            static constexpr entry_t    kMask = 0xffff;
+            static constexpr bool       kRootDirIsChain = false;
+            static constexpr size_t     kEntryBytes = 2;
+
+            static constexpr size_t entry_offset(size_t cluster)
+            {
+                return cluster * 2;
+            }
+            static constexpr size_t fat_bytes(size_t count)
+            {
+                return count * 2;
+            }
+            static entry_t get_entry(const uint8_t* bytes, size_t)
+            {
+                return entry_t(bytes[0] | (bytes[1] << 8));
+            }
+            static void set_entry(uint8_t* bytes, size_t, entry_t value)
+            {
+                bytes[0] = uint8_t(value);
+                bytes[1] = uint8_t(value >> 8);
+            }
+        };
+
+        template<>
+        struct fat_traits_t<32>
+        {
+            using entry_t = uint32_t;
+            static constexpr unsigned   kBits = 32;
+            static constexpr fat_type   kType = fat_type::kFat32;
+            static constexpr entry_t    kEOC = kFat32EOC;
+            // the upper 4 bits are reserved
+            static constexpr entry_t    kMask = 0x0fffffff;
+            // the root directory is a cluster chain like any other directory, starting at the cluster in the boot sector
+            static constexpr bool       kRootDirIsChain = true;
+            static constexpr size_t     kEntryBytes = 4;
+
+            static constexpr size_t entry_offset(size_t cluster)
+            {
+                return cluster * 4;
+            }
+            static constexpr size_t fat_bytes(size_t count)
+            {
+                return count * 4;
+            }
+            static entry_t get_entry(const uint8_t* bytes, size_t)
+            {
+                return (bytes[0] | (entry_t(bytes[1]) << 8) | (entry_t(bytes[2]) << 16) | (entry_t(bytes[3]) << 24)) & kMask;
+            }
+            // the reserved bits must be preserved
+            static void set_entry(uint8_t* bytes, size_t, entry_t value)
+            {
+                bytes[0] = uint8_t(value);
+                bytes[1] = uint8_t(value >> 8);
+                bytes[2] = uint8_t(value >> 16);
+                bytes[3] = uint8_t((bytes[3] & 0xf0) | ((value >> 24) & 0x0f));
+            }
+        };
 
         struct disksize_to_sectors_per_cluster
         {
@@ -148,6 +325,15 @@ namespace disktools
             uint8_t		_sectors_per_cluster;
         };
 
+        // Microsoft's document has no table for FAT12, these keep the cluster count below kFat12MaxClusters for 
+        // the smallest cluster size that does. Anything bigger is FAT16
+        static constexpr disksize_to_sectors_per_cluster kDiskTableFat12[] =
+        {
+            {   4096,   1},     /* disks up to 2 MB, 512 byte cluster */
+            {   8192,   2},     /* disks up to 4 MB,  1k cluster */
+            {  16384,   4},     /* disks up to 8 MB,  2k cluster */
+            {  32680,   8},     /* disks up to 16 MB, 4k cluster */
+        };
         // from Microsoft's FAT format technical design document
         static constexpr disksize_to_sectors_per_cluster kDiskTableFat16[] =
         {
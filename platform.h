@@ -9,10 +9,17 @@
 #endif
 
 #ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
 #define xstricmp(a,b) _stricmp(a,b)
+#define xset_stdin_binary() _setmode(_fileno(stdin), _O_BINARY)
+// separates paths in a list, as in PATH
+static constexpr char kPathListSeparator = ';';
 #else
 #include <cstring>
 #include <strings.h>
 #define xstricmp(a,b) strcasecmp(a,b)
+#define xset_stdin_binary()
+static constexpr char kPathListSeparator = ':';
 #endif
 
@@ -0,0 +1,241 @@
+
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+
+#include "simd.h"
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define SIMD_X64
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+// MSVC lets us use any intrinsic regardless of the target architecture
+#define SIMD_TARGET_AVX2
+#else
+#define SIMD_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+namespace simd
+{
+    namespace
+    {
+        using is_zero_func_t = bool(*)(const uint8_t*, size_t);
+        using iota16_func_t = void(*)(uint16_t*, size_t, uint16_t);
+        using iota32_func_t = void(*)(uint32_t*, size_t, uint32_t);
+
+        bool is_zero_scalar(const uint8_t* data, size_t bytes)
+        {
+            const auto* end = data + (bytes & ~size_t(63));
+            for (; data < end; data += 64)
+            {
+                uint64_t words[8];
+                memcpy(words, data, sizeof words);
+                if (words[0] | words[1] | words[2] | words[3] | words[4] | words[5] | words[6] | words[7])
+                {
+                    return false;
+                }
+            }
+            uint8_t tail = 0;
+            for (end = data + (bytes & 63); data < end; ++data)
+            {
+                tail |= *data;
+            }
+            return !tail;
+        }
+
+        template<typename T>
+        void iota_scalar(T* out, size_t count, T first)
+        {
+            for (; count; --count)
+            {
+                *out++ = first++;
+            }
+        }
+
+#ifdef SIMD_X64
+        // SSE2 is part of x64 so this is always available
+        bool is_zero_sse2(const uint8_t* data, size_t bytes)
+        {
+            const auto* end = data + (bytes & ~size_t(63));
+            for (; data < end; data += 64)
+            {
+                const auto* p = reinterpret_cast<const __m128i*>(data);
+                const auto ored = _mm_or_si128(_mm_or_si128(_mm_loadu_si128(p), _mm_loadu_si128(p + 1)),
+                    _mm_or_si128(_mm_loadu_si128(p + 2), _mm_loadu_si128(p + 3)));
+                if (_mm_movemask_epi8(_mm_cmpeq_epi8(ored, _mm_setzero_si128())) != 0xffff)
+                {
+                    return false;
+                }
+            }
+            return is_zero_scalar(data, bytes & 63);
+        }
+
+        // 4 stores per loop, each of 8 (16 bit) or 4 (32 bit) consecutive values
+        void iota16_sse2(uint16_t* out, size_t count, uint16_t first)
+        {
+            auto values = _mm_add_epi16(_mm_set1_epi16(int16_t(first)), _mm_setr_epi16(0, 1, 2, 3, 4, 5, 6, 7));
+            const auto step = _mm_set1_epi16(8);
+            for (; count >= 32; count -= 32, out += 32, first = uint16_t(first + 32))
+            {
+                auto* p = reinterpret_cast<__m128i*>(out);
+                _mm_storeu_si128(p, values);
+                _mm_storeu_si128(p + 1, values = _mm_add_epi16(values, step));
+                _mm_storeu_si128(p + 2, values = _mm_add_epi16(values, step));
+                _mm_storeu_si128(p + 3, values = _mm_add_epi16(values, step));
+                values = _mm_add_epi16(values, step);
+            }
+            iota_scalar(out, count, first);
+        }
+
+        void iota32_sse2(uint32_t* out, size_t count, uint32_t first)
+        {
+            auto values = _mm_add_epi32(_mm_set1_epi32(int32_t(first)), _mm_setr_epi32(0, 1, 2, 3));
+            const auto step = _mm_set1_epi32(4);
+            for (; count >= 16; count -= 16, out += 16, first += 16)
+            {
+                auto* p = reinterpret_cast<__m128i*>(out);
+                _mm_storeu_si128(p, values);
+                _mm_storeu_si128(p + 1, values = _mm_add_epi32(values, step));
+                _mm_storeu_si128(p + 2, values = _mm_add_epi32(values, step));
+                _mm_storeu_si128(p + 3, values = _mm_add_epi32(values, step));
+                values = _mm_add_epi32(values, step);
+            }
+            iota_scalar(out, count, first);
+        }
+
+        SIMD_TARGET_AVX2
+        bool is_zero_avx2(const uint8_t* data, size_t bytes)
+        {
+            const auto* end = data + (bytes & ~size_t(127));
+            for (; data < end; data += 128)
+            {
+                const auto* p = reinterpret_cast<const __m256i*>(data);
+                const auto ored = _mm256_or_si256(_mm256_or_si256(_mm256_loadu_si256(p), _mm256_loadu_si256(p + 1)),
+                    _mm256_or_si256(_mm256_loadu_si256(p + 2), _mm256_loadu_si256(p + 3)));
+                if (!_mm256_testz_si256(ored, ored))
+                {
+                    return false;
+                }
+            }
+            return is_zero_sse2(data, bytes & 127);
+        }
+
+        SIMD_TARGET_AVX2
+        void iota16_avx2(uint16_t* out, size_t count, uint16_t first)
+        {
+            auto values = _mm256_add_epi16(_mm256_set1_epi16(int16_t(first)), _mm256_setr_epi16(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15));
+            const auto step = _mm256_set1_epi16(16);
+            for (; count >= 64; count -= 64, out += 64, first = uint16_t(first + 64))
+            {
+                auto* p = reinterpret_cast<__m256i*>(out);
+                _mm256_storeu_si256(p, values);
+                _mm256_storeu_si256(p + 1, values = _mm256_add_epi16(values, step));
+                _mm256_storeu_si256(p + 2, values = _mm256_add_epi16(values, step));
+                _mm256_storeu_si256(p + 3, values = _mm256_add_epi16(values, step));
+                values = _mm256_add_epi16(values, step);
+            }
+            iota16_sse2(out, count, first);
+        }
+
+        SIMD_TARGET_AVX2
+        void iota32_avx2(uint32_t* out, size_t count, uint32_t first)
+        {
+            auto values = _mm256_add_epi32(_mm256_set1_epi32(int32_t(first)), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+            const auto step = _mm256_set1_epi32(8);
+            for (; count >= 32; count -= 32, out += 32, first += 32)
+            {
+                auto* p = reinterpret_cast<__m256i*>(out);
+                _mm256_storeu_si256(p, values);
+                _mm256_storeu_si256(p + 1, values = _mm256_add_epi32(values, step));
+                _mm256_storeu_si256(p + 2, values = _mm256_add_epi32(values, step));
+                _mm256_storeu_si256(p + 3, values = _mm256_add_epi32(values, step));
+                values = _mm256_add_epi32(values, step);
+            }
+            iota32_sse2(out, count, first);
+        }
+
+        bool has_avx2()
+        {
+#ifdef _MSC_VER
+            // AVX2 has to be supported by the CPU, and the OS has to save the YMM registers
+            int regs[4];
+            __cpuid(regs, 1);
+            const auto osxsave_avx = (1 << 27) | (1 << 28);
+            if ((regs[2] & osxsave_avx) != osxsave_avx || (_xgetbv(0) & 6) != 6)
+            {
+                return false;
+            }
+            __cpuidex(regs, 7, 0);
+            return (regs[1] & (1 << 5)) != 0;
+#else
+            return __builtin_cpu_supports("avx2");
+#endif
+        }
+#endif
+
+        struct implementation_t
+        {
+            is_zero_func_t  _is_zero;
+            iota16_func_t   _iota16;
+            iota32_func_t   _iota32;
+            const char*     _name;
+        };
+
+        implementation_t select_implementation()
+        {
+#ifdef SIMD_X64
+            if (has_avx2())
+            {
+                return { is_zero_avx2, iota16_avx2, iota32_avx2, "avx2" };
+            }
+            return { is_zero_sse2, iota16_sse2, iota32_sse2, "sse2" };
+#else
+            return { is_zero_scalar, iota_scalar<uint16_t>, iota_scalar<uint32_t>, "scalar" };
+#endif
+        }
+
+        const implementation_t kImplementation = select_implementation();
+
+        const is_zero_variant_t kIsZeroVariants[] = {
+            { "scalar", is_zero_scalar },
+#ifdef SIMD_X64
+            { "sse2", is_zero_sse2 },
+            { "avx2", is_zero_avx2 },
+#endif
+        };
+    }
+
+    bool is_zero(const void* data, size_t bytes)
+    {
+        return kImplementation._is_zero(static_cast<const uint8_t*>(data), bytes);
+    }
+
+    void iota(uint16_t* out, size_t count, uint16_t first)
+    {
+        kImplementation._iota16(out, count, first);
+    }
+
+    void iota(uint32_t* out, size_t count, uint32_t first)
+    {
+        kImplementation._iota32(out, count, first);
+    }
+
+    const char* is_zero_implementation()
+    {
+        return kImplementation._name;
+    }
+
+    size_t is_zero_variants(const is_zero_variant_t** variants)
+    {
+        *variants = kIsZeroVariants;
+        // they are in order, the one in use is the last one that can run
+        size_t count = 1;
+        while (count < std::size(kIsZeroVariants) && kIsZeroVariants[count - 1]._is_zero != kImplementation._is_zero)
+        {
+            ++count;
+        }
+        return count;
+    }
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace simd
+{
+    // true if all bytes of data are 0. 
+    // uses AVX2 or SSE2 where available, as determined at runtime, and plain C++ everywhere else
+    bool is_zero(const void* data, size_t bytes);
+
+    // out[n] = first + n for count entries, e.g. a run of FAT entries that each point to the next cluster. 
+    // 16 bit values wrap around, 32 bit ones are used for 28 bit FAT32 entries as well
+    void iota(uint16_t* out, size_t count, uint16_t first);
+    void iota(uint32_t* out, size_t count, uint32_t first);
+
+    // the name of the implementation used by is_zero and iota, e.g. "avx2"
+    const char* is_zero_implementation();
+
+    // an implementation of is_zero, see is_zero_variants
+    struct is_zero_variant_t
+    {
+        const char*     _name;
+        bool            (*_is_zero)(const uint8_t* data, size_t bytes);
+    };
+    // the implementations of is_zero this CPU can run, from plain C++ up to the one is_zero uses, for comparing them 
+    // (see bench/is_zero_bench.cpp). returns how many there are
+    size_t is_zero_variants(const is_zero_variant_t** variants);
+}
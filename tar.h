@@ -0,0 +1,54 @@
+#pragma once
+
+namespace disktools
+{
+    namespace tar
+    {
+        // POSIX.1-2001 ustar and pax interchange formats: https://pubs.opengroup.org/onlinepubs/9699919799/utilities/pax.html
+
+        static constexpr size_t kBlockSizeBytes = 512;
+        static constexpr uint8_t kUstarMagic[5] = { 'u','s','t','a','r' };
+
+#pragma pack(push,1)
+        struct ustar_header_t
+        {
+            char            _name[100];
+            char            _mode[8];
+            char            _uid[8];
+            char            _gid[8];
+            char            _size[12];          // octal, or base-256 if the high bit of the first byte is set
+            char            _mtime[12];
+            char            _chksum[8];         // octal sum of all header bytes with this field taken as spaces
+            char            _typeflag;
+            char            _linkname[100];
+            char            _magic[6];          // "ustar\0" (POSIX) or "ustar " (GNU)
+            char            _version[2];
+            char            _uname[32];
+            char            _gname[32];
+            char            _devmajor[8];
+            char            _devminor[8];
+            char            _prefix[155];       // prepended to _name with a '/' if not empty
+            char            _pad[12];
+        };
+#pragma pack(pop)
+
+        static_assert(sizeof(ustar_header_t) == kBlockSizeBytes);
+
+        enum class type_flag : char
+        {
+            kRegular = '0',
+            kRegularOld = '\0',
+            kHardLink = '1',
+            kSymLink = '2',
+            kCharDevice = '3',
+            kBlockDevice = '4',
+            kDirectory = '5',
+            kFifo = '6',
+            kContiguous = '7',
+            kPaxExtended = 'x',     // pax extended header for the next entry
+            kPaxGlobal = 'g',       // pax extended header for all following entries
+            kGnuLongName = 'L',     // GNU; the data is the name of the next entry
+            kGnuLongLink = 'K',     // GNU; the data is the link name of the next entry
+        };
+    }
+}